@@ -0,0 +1,5616 @@
+/***********************************
+libmfs: the file system core behind the mfs shell. See mfs.h for the interface.
+
+HOW TO BUILD libmfs on its own:
+
+gcc -g -Wall -Werror --std=c99 -c libmfs.c && ar rcs libmfs.a libmfs.o
+
+Saves and inserts hand their I/O to io_uring when the kernel offers it. Add -DMFS_NO_IO_URING on
+systems without <linux/io_uring.h>; everything then runs through plain system calls.
+************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <glob.h>
+#include <pthread.h>
+#ifndef MFS_NO_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "mfs.h"
+
+#define MFS_MAGIC 0x3153464d          // "MFS1"
+#define BLOCKS_PER_INODE 16           // createfs sizes the inode table at one inode per 16 blocks by default
+#define DIRECT_EXTENTS 4
+#define MAX_READER_THREADS 8          // threads copying source files in during insert
+#define MAX_SNAPSHOTS 16
+#define MAX_DEDUP_REFS (UINT16_MAX / (MAX_SNAPSHOTS + 1))   // each snapshot may add as many references as the image holds
+#define MIN_BLOCK_INDEX 1024          // slots in the dedup index when it is first built
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+#define COMPRESS_CHUNK 65536          // bytes of a compressed file that are compressed, and read back, as a unit
+#define LZ_HASH_BITS 12               // match finder table of 4096 recent positions
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define SNAPSHOT_EXTENTS 8            // runs a snapshot's metadata copy may be split into
+#define JOURNAL_MAGIC 0x4c4e524a      // "JRNL"
+#define JOURNAL_DATA_SHARE 64         // besides all of the metadata, the journal holds one block per 64 data blocks...
+#define MAX_JOURNAL_DATA 8192         // ...up to this many
+#define JOURNAL_IOVECS 64             // journaled blocks handed to each pwritev
+#define RING_ENTRIES 64               // requests an io_uring keeps in flight
+#define RING_CHUNK (1024 * 1024)      // most bytes one ring request moves, so a long run is spread over several
+#define CHECKSUM_SEED 2166136261u
+#define CRC32C_POLY 0x82f63b78        // Castagnoli polynomial, bit reversed
+#define SCRUB_BLOCKS 4096             // blocks a scrub worker takes at a time
+#define READAHEAD_MIN (128 * 1024)    // bytes a sequential reader is read ahead by at first...
+#define READAHEAD_MAX (4 * 1024 * 1024)   // ...doubling with each read that carries on up to this
+
+//the superblock lives at the start of block 0 and records the geometry of the image.
+//Every region offset is a block number.
+struct superblock
+{
+    uint32_t magic;
+    int32_t  block_size;
+    int32_t  num_blocks;
+    int32_t  num_files;
+    int32_t  directory_block;
+    int32_t  free_inode_block;
+    int32_t  inode_block;
+    int32_t  free_map_block;
+    int32_t  first_data_block;
+    int32_t  journal_block;     // images made before the journal have 0 journal_blocks
+    int32_t  journal_blocks;
+    int32_t  refcount_block;    // images made before snapshots have 0 here and no reference counts
+    int32_t  snapshot_block;
+    int32_t  checksum_block;    // images made before block checksums have 0 here
+};
+
+//the first block of the journal. A save writes the blocks it changes to the journal, then this header,
+//then the blocks in place. count is the number of blocks in the last transaction until they are all in
+//place, 0 after that. The journaled blocks follow the descriptor blocks, which hold their block numbers.
+struct journalHeader
+{
+    uint32_t magic;
+    int32_t  count;
+    uint32_t checksum;          // FNV-1a of the descriptors in use and the journaled blocks
+};
+
+//directory structure
+struct directoryEntry
+{
+    char    filename[64];
+    short   in_use;
+    int32_t inode;
+    uint8_t hidden;
+    uint8_t readOnly;
+};
+
+//a run of contiguous data blocks belonging to a file
+struct extent
+{
+    int32_t start;
+    int32_t length;
+};
+
+//a snapshot keeps its own copy of the directory, free inode map and inode table, stored in data blocks,
+//and of the indirect blocks of its files. File data is shared with the image until one side changes it.
+struct snapshotEntry
+{
+    char          name[64];
+    int32_t       in_use;
+    struct extent copy[SNAPSHOT_EXTENTS];   // where the metadata copy lives, ending at the first empty extent
+};
+
+//inode structure. The extent list ends at the first extent with a length of 0. The first
+//DIRECT_EXTENTS live in the inode, the next EXTENTS_PER_BLOCK in the indirect block and the
+//rest in the indirect blocks listed by the double-indirect block. Unused pointers are -1.
+struct inode
+{
+    struct extent extents[DIRECT_EXTENTS];
+    int32_t  indirect;
+    int32_t  double_indirect;
+	uint32_t file_size;
+    short    in_use;
+	uint8_t  attribute;
+};
+
+//an entry of the dedup index
+struct blockHash
+{
+    uint64_t hash;
+    int32_t  block;
+};
+
+// the kinds of request an ioRing carries
+enum ringOp { RING_READ, RING_WRITE, RING_WRITEV, RING_PUNCH };
+
+// one request handed to an ioRing, kept until it completes so that one the kernel fails or cuts
+// short can be finished with the plain system call it stands for
+struct ringRequest
+{
+    int      op;
+    int      fd;
+    int      busy;
+    int      iovcnt;
+    uint8_t *buf;             // for RING_PUNCH, the bytes to write instead if no hole can be punched, or NULL
+    size_t   len;
+    off_t    pos;
+    struct iovec iov[JOURNAL_IOVECS];
+};
+
+// an io_uring driven with raw system calls. Requests are queued in the submission ring and handed to
+// the kernel together, which works through up to RING_ENTRIES of them at once instead of one after
+// another. Whatever the kernel fails or cuts short, and everything once the ring itself stops working,
+// is redone synchronously, so the outcome is the same as without one. One thread at a time may use a ring.
+struct ioRing
+{
+    int       fd;
+    int       broken;           // set once io_uring_enter fails, after which requests run synchronously
+    int       error;            // errno of the first request that failed since the last ringFinish
+    unsigned  queued;           // requests not yet handed to the kernel
+    unsigned  in_flight;        // requests not yet completed, queued ones included
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void     *sqes, *cqes;
+    void     *sq_map, *cq_map;
+    size_t    sq_map_size, cq_map_size, sqes_size;
+    int       free_count;
+    int       free_slots[RING_ENTRIES];
+    struct ringRequest requests[RING_ENTRIES];
+};
+
+//everything we know about one open image
+struct mfs
+{
+    struct superblock *sb;
+
+    // data points into a MAP_PRIVATE mapping of the image file, so only the
+    // blocks we actually touch are ever faulted in from disk and nothing reaches
+    // the file until savefs writes it back
+    uint8_t *data;
+    size_t   data_size;
+    int      image_fd;
+
+    // one bit per block modified since the last save
+    uint64_t *dirty_blocks;
+
+    // the free map as of the last save, which is what the image file holds. Blocks free in it can
+    // be written in place without a crash being able to hurt anything the file still uses.
+    uint64_t *saved_free;
+
+    // set from createfs until the first save, when there is nothing in the file to protect yet
+    int fresh;
+
+    // one bit per block freed since the last save. Once a save is on disk, the blocks still free are
+    // punched out of the image file so they take no space on the host. Every free block of an image
+    // that has just been opened counts, so its first save clears out what older versions left behind.
+    uint64_t *freed_blocks;
+
+    // one bit per block, set when the block is free. Metadata blocks are never free.
+    uint64_t *free_blocks;
+    uint8_t  *free_inodes;
+
+    // a count per data block of the files and snapshots that use it. A block is free when
+    // its count is 0 and written in place only while it is 1; the image copies it before changing a
+    // block a snapshot shares. NULL for images made before snapshots, where used is all there is.
+    uint16_t             *refcounts;
+    struct snapshotEntry *snapshots;
+
+    // content hashes of file data blocks for insert's dedup mode, built the first time it is used.
+    // Open addressing on the hash; a block of -1 marks an empty slot. hashed_blocks has a bit per
+    // block in the index that freeing the block clears, so an entry is only trusted while its bit is
+    // set and the block still holds the same bytes.
+    struct blockHash *block_index;
+    uint32_t          block_index_size;
+    uint32_t          block_index_count;
+    uint64_t         *hashed_blocks;
+
+    // kept in step with free_blocks so df and the insert space check never have to scan
+    int32_t free_block_count;
+    int32_t free_block_hint;
+
+    struct directoryEntry *directory;
+    struct inode          *inodes;
+
+    // open-addressing hash table of directory indices keyed on filename, -1 marks an empty slot.
+    // Deleted entries stay indexed so undel can find them; only reusing their slot removes them.
+    // Sized to a power of two at least twice the number of files.
+    int32_t *name_index;
+    uint32_t name_index_size;
+
+    // a CRC32C of every block outside the checksum region and the journal, brought up to date for the
+    // blocks a save writes. A block is checked the first time it is read after the image is opened,
+    // unless it has changed since, and verified_blocks gets its bit. NULL for images made before checksums.
+    uint32_t *checksums;
+    uint64_t *verified_blocks;
+
+    // the block cache. With a limit set by mfs_set_cache_size, the data blocks reads and saves leave in the
+    // mapping are counted in units of a page, or of a block if that is larger. Past the limit a CLOCK hand
+    // sweeps the units, clearing referenced bits and dropping the first clean unit it finds without one
+    // with MADV_DONTNEED, after which it is read back from the file if it is needed again. Blocks changed
+    // since the last save are never dropped. Readers share the handle, so cache_lock guards all of this.
+    pthread_mutex_t cache_lock;
+    int32_t   cache_limit;          // units, 0 for no limit
+    int32_t   cache_count;
+    int32_t   cache_hand;
+    int32_t   unit_blocks;
+    uint64_t *cached_units;
+    uint64_t *referenced_units;
+
+    // sequential readahead: where the last read ended, how far ahead of it has been asked for and the
+    // window, which doubles with each read that starts where the last one ended. Also under cache_lock.
+    int32_t  stream_inode;
+    uint64_t stream_end;
+    uint64_t stream_ahead;
+    uint64_t stream_window;
+
+    // the io_uring saves queue their writes on, set up by the first save. NULL if the kernel has none.
+    struct ioRing *ring;
+    int            ring_tried;
+
+    // held for reading by calls that only look at the image and for writing by calls that change it
+    pthread_rwlock_t lock;
+
+    // totals for mfs_get_counters. Calls holding the lock for reading update them too, so every
+    // update goes through addCount.
+    struct mfs_counters counters;
+};
+
+//an open file. The handle names a directory slot and inode; if the file in that slot is deleted
+//or replaced, the handle goes stale.
+struct mfs_file
+{
+    mfs_t   *fs;
+    char     name[MFS_NAME_MAX + 1];
+    int32_t  entry;
+    int32_t  inode;
+    int      flags;
+    uint64_t position;
+};
+
+//values derived from the geometry of the image open on fs, which every user has in scope
+#define FREE_MAP_WORDS ((fs->sb->num_blocks + 63) / 64)
+#define EXTENTS_PER_BLOCK (fs->sb->block_size / 8)       // extents held by an indirect block
+#define POINTERS_PER_BLOCK (fs->sb->block_size / 4)      // indirect blocks held by a double-indirect block
+#define MAX_FILE_SIZE ((size_t)(fs->sb->num_blocks - fs->sb->first_data_block) * fs->sb->block_size)
+
+
+/*************************************** HELPER FUNCTIONS ********************************************/
+
+
+// Helper function that returns a pointer to the contents of block n of the open image
+static uint8_t *get_block(mfs_t *fs, int32_t n)
+{
+	return fs->data + (size_t)n * fs->sb->block_size;
+}
+
+// Helper function that flags every block overlapping [ptr, ptr + len) as needing to be written by savefs
+static void mark_dirty(mfs_t *fs, const void *ptr, size_t len)
+{
+	size_t offset = (const uint8_t *)ptr - fs->data;
+	size_t block;
+
+	for(block = offset / fs->sb->block_size; block <= (offset + len - 1) / fs->sb->block_size; block++)
+	{
+		fs->dirty_blocks[block / 64] |= 1ULL << (block % 64);
+	}
+}
+
+// Helper function that adds n to one of the handle's counters
+static void addCount(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Helper function that returns 1 if the block has been modified since the last save
+static int is_dirty(mfs_t *fs, int32_t block)
+{
+	return (fs->dirty_blocks[block / 64] >> (block % 64)) & 1;
+}
+
+// Helper function that writes all len bytes of buf to fd at pos. Returns 0 on success and -1 on failure
+static int pwriteAll(int fd, const void *buf, size_t len, off_t pos)
+{
+	const uint8_t *bytes = buf;
+	while(len > 0)
+	{
+		ssize_t written = pwrite(fd, bytes, len, pos);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		bytes += written;
+		len   -= written;
+		pos   += written;
+	}
+	return 0;
+}
+
+// Helper function that returns 1 if block's bit is set in the one-bit-per-block map blocks
+static int testBlock(const uint64_t *blocks, int32_t block)
+{
+	return (blocks[block / 64] >> (block % 64)) & 1;
+}
+
+// Helper function that returns 1 if the len bytes at p are all zero. A block that holds anything
+// rarely starts with 8 zero bytes, so this usually stops at the first word.
+static int isZeroBlock(const uint8_t *p, size_t len)
+{
+	size_t i;
+	for(i = 0; i < len; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, p + i, sizeof(word));
+		if(word)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Helper function that turns len bytes at offset pos of the image file into a hole, which reads back
+// as zeros and takes no space on the host. Returns 0 on success and -1 if the host file system
+// cannot punch holes.
+static int punchHole(int fd, off_t pos, size_t len)
+{
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len);
+}
+
+// Helper function that finishes a ring request with plain system calls, done bytes in. A read that reaches
+// the end of the file zeroes the rest of its buffer. A failure is recorded in ring->error
+static void finishRequest(struct ioRing *ring, struct ringRequest *req, size_t done)
+{
+	int status = 0;
+	int i;
+
+	switch(req->op)
+	{
+	case RING_PUNCH:
+		if(punchHole(req->fd, req->pos, req->len) < 0 && req->buf)
+		{
+			status = pwriteAll(req->fd, req->buf, req->len, req->pos);
+		}
+		break;
+	case RING_WRITE:
+		status = pwriteAll(req->fd, req->buf + done, req->len - done, req->pos + done);
+		break;
+	case RING_WRITEV:
+		for(i = 0; status == 0 && i < req->iovcnt; i++)
+		{
+			size_t skip = done < req->iov[i].iov_len ? done : req->iov[i].iov_len;
+			status = pwriteAll(req->fd, (uint8_t *)req->iov[i].iov_base + skip, req->iov[i].iov_len - skip, req->pos + skip);
+			done     -= skip;
+			req->pos += req->iov[i].iov_len;
+		}
+		break;
+	case RING_READ:
+		while(done < req->len)
+		{
+			ssize_t got = pread(req->fd, req->buf + done, req->len - done, req->pos + done);
+			if(got < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if(got < 0)
+			{
+				status = -1;
+			}
+			if(got <= 0)
+			{
+				break;
+			}
+			done += got;
+		}
+		memset(req->buf + done, 0, req->len - done);
+		break;
+	}
+	if(status < 0 && !ring->error)
+	{
+		ring->error = errno;
+	}
+}
+
+// Helper function that releases a ring from ringSetup, which may be NULL
+static void ringTeardown(struct ioRing *ring)
+{
+	if(!ring)
+	{
+		return;
+	}
+	if(ring->sq_map && ring->sq_map != MAP_FAILED)
+	{
+		munmap(ring->sq_map, ring->sq_map_size);
+	}
+	if(ring->cq_map && ring->cq_map != MAP_FAILED)
+	{
+		munmap(ring->cq_map, ring->cq_map_size);
+	}
+	if(ring->sqes && ring->sqes != MAP_FAILED)
+	{
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	close(ring->fd);
+	free(ring);
+}
+
+#ifndef MFS_NO_IO_URING
+// Helper function that retires the request in slot, which completed with res: bytes moved, or a negative errno
+static void completeRequest(struct ioRing *ring, int slot, int res)
+{
+	struct ringRequest *req = &ring->requests[slot];
+	if(res < 0 || (req->op != RING_PUNCH && (size_t)res < req->len))
+	{
+		finishRequest(ring, req, res > 0 && req->op != RING_PUNCH ? (size_t)res : 0);
+	}
+	req->busy = 0;
+	ring->free_slots[ring->free_count++] = slot;
+	ring->in_flight--;
+}
+
+// Helper function that returns a new ring with room for RING_ENTRIES requests, or NULL if the kernel
+// does not offer io_uring or will not let us use it, in which case callers do their I/O synchronously
+static struct ioRing *ringSetup(void)
+{
+	struct io_uring_params params;
+	struct ioRing *ring = calloc(1, sizeof(struct ioRing));
+	int slot;
+
+	if(!ring)
+	{
+		return NULL;
+	}
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if(ring->fd < 0)
+	{
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size   = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes   = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		ringTeardown(ring);
+		return NULL;
+	}
+
+	uint8_t *sq = ring->sq_map;
+	uint8_t *cq = ring->cq_map;
+	ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes     = cq + params.cq_off.cqes;
+	for(slot = 0; slot < RING_ENTRIES; slot++)
+	{
+		ring->free_slots[slot] = slot;
+	}
+	ring->free_count = RING_ENTRIES;
+	return ring;
+}
+
+// Helper function that fills in the next submission queue entry for the request in slot
+static void ringPush(struct ioRing *ring, int slot)
+{
+	struct ringRequest  *req   = &ring->requests[slot];
+	unsigned             tail  = *ring->sq_tail;
+	unsigned             index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe   = (struct io_uring_sqe *)ring->sqes + index;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd        = req->fd;
+	sqe->off       = req->pos;
+	sqe->user_data = slot;
+	switch(req->op)
+	{
+	case RING_READ:
+		sqe->opcode = IORING_OP_READ;
+		sqe->addr   = (uintptr_t)req->buf;
+		sqe->len    = req->len;
+		break;
+	case RING_WRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->addr   = (uintptr_t)req->buf;
+		sqe->len    = req->len;
+		break;
+	case RING_WRITEV:
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr   = (uintptr_t)req->iov;
+		sqe->len    = req->iovcnt;
+		break;
+	case RING_PUNCH:
+		sqe->opcode = IORING_OP_FALLOCATE;
+		sqe->addr   = req->len;
+		sqe->len    = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+		break;
+	}
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Helper function that retires every request the kernel has completed
+static void ringHarvest(struct ioRing *ring)
+{
+	unsigned head = *ring->cq_head;
+	while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe *cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+		completeRequest(ring, (int)cqe->user_data, cqe->res);
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Helper function that hands the queued requests to the kernel and retires every one that has completed,
+// first waiting for at least wait of them. Returns 0 on success and -1 if io_uring_enter fails
+static int ringReap(struct ioRing *ring, unsigned wait)
+{
+	while(ring->queued > 0 || wait > 0)
+	{
+		int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if(submitted >= 0)
+		{
+			ring->queued -= submitted;
+			break;
+		}
+		if(errno != EINTR)
+		{
+			return -1;
+		}
+	}
+
+	ringHarvest(ring);
+	return 0;
+}
+
+// Helper function that gives up on a ring whose io_uring_enter has failed. The entries the kernel has not taken
+// are pulled back out of the submission ring, then we wait for every request it did take to complete, and only
+// then are the pulled back ones redone synchronously. Nothing the kernel holds can land in a buffer after this.
+static void breakRing(struct ioRing *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail;
+	unsigned lost = tail - head;
+	int      slots[RING_ENTRIES];
+	unsigned i;
+
+	for(i = 0; i < lost; i++)
+	{
+		unsigned index = ring->sq_array[(head + i) & *ring->sq_mask];
+		slots[i] = (int)((struct io_uring_sqe *)ring->sqes)[index].user_data;
+	}
+	__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+	ring->queued = 0;
+
+	// waiting is the only safe way out, so keep at it whatever io_uring_enter says
+	while(ring->in_flight > lost)
+	{
+		syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		ringHarvest(ring);
+	}
+
+	ring->broken = 1;
+	for(i = 0; i < lost; i++)
+	{
+		completeRequest(ring, slots[i], -EIO);
+	}
+}
+#else
+static struct ioRing *ringSetup(void)
+{
+	return NULL;
+}
+
+static void ringPush(struct ioRing *ring, int slot)
+{
+}
+
+static int ringReap(struct ioRing *ring, unsigned wait)
+{
+	return -1;
+}
+
+static void breakRing(struct ioRing *ring)
+{
+	ring->broken = 1;
+}
+#endif
+
+// Helper function that queues a request on ring, first waiting for one to complete if all RING_ENTRIES are
+// in flight. iov and iovcnt are only for RING_WRITEV, whose len is the total length of the vectors
+static void ringQueue(struct ioRing *ring, int op, int fd, void *buf, size_t len, off_t pos, const struct iovec *iov, int iovcnt)
+{
+	while(!ring->broken && ring->free_count == 0)
+	{
+		if(ringReap(ring, 1) < 0)
+		{
+			breakRing(ring);
+		}
+	}
+
+	int                 slot = ring->free_slots[--ring->free_count];
+	struct ringRequest *req  = &ring->requests[slot];
+	req->op     = op;
+	req->fd     = fd;
+	req->buf    = buf;
+	req->len    = len;
+	req->pos    = pos;
+	req->iovcnt = iovcnt;
+	if(iovcnt > 0)
+	{
+		memcpy(req->iov, iov, iovcnt * sizeof(struct iovec));
+	}
+
+	if(ring->broken)
+	{
+		finishRequest(ring, req, 0);
+		ring->free_slots[ring->free_count++] = slot;
+		return;
+	}
+	req->busy = 1;
+	ringPush(ring, slot);
+	ring->queued++;
+	ring->in_flight++;
+}
+
+// Helper function that waits for every request queued on ring. Returns 0 if they all succeeded and -1
+// with errno set by the first that failed otherwise
+static int ringFinish(struct ioRing *ring)
+{
+	while(ring->in_flight > 0)
+	{
+		if(ringReap(ring, 1) < 0)
+		{
+			breakRing(ring);
+		}
+	}
+	if(ring->error)
+	{
+		errno       = ring->error;
+		ring->error = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Helper function that returns the handle's ring, setting it up the first time, or NULL to do I/O synchronously.
+// Only saves use it, and they hold the lock for writing.
+static struct ioRing *handleRing(mfs_t *fs)
+{
+	if(!fs->ring_tried)
+	{
+		fs->ring_tried = 1;
+		fs->ring       = ringSetup();
+	}
+	return fs->ring;
+}
+
+// Helper function that writes every block whose bit is set in blocks back to the image, coalescing
+// runs of adjacent blocks into a single pwrite. Runs of zero blocks are punched out of the file
+// instead of written, so fresh and mostly empty images stay sparse. With a ring, the runs are queued on it
+// in pieces of up to RING_CHUNK bytes and all written at once. Returns 0 on success and -1 on failure
+static int writeRuns(mfs_t *fs, const uint64_t *blocks)
+{
+	struct ioRing *ring  = handleRing(fs);
+	int32_t        block = 0;
+
+	while(block < fs->sb->num_blocks)
+	{
+		// skip 64 clean blocks at a time
+		if(blocks[block / 64] == 0)
+		{
+			block = (block / 64 + 1) * 64;
+			continue;
+		}
+		if(!testBlock(blocks, block))
+		{
+			block++;
+			continue;
+		}
+
+		int32_t start = block;
+		int     zero  = isZeroBlock(get_block(fs, block), fs->sb->block_size);
+		for(block++; block < fs->sb->num_blocks && testBlock(blocks, block) &&
+		             isZeroBlock(get_block(fs, block), fs->sb->block_size) == zero; block++)
+		{
+		}
+
+		size_t len = (size_t)(block - start) * fs->sb->block_size;
+		off_t  pos = (off_t)start * fs->sb->block_size;
+		if(ring && zero)
+		{
+			ringQueue(ring, RING_PUNCH, fs->image_fd, get_block(fs, start), len, pos, NULL, 0);
+			continue;
+		}
+		if(ring)
+		{
+			size_t done;
+			for(done = 0; done < len; done += RING_CHUNK)
+			{
+				size_t piece = len - done < RING_CHUNK ? len - done : RING_CHUNK;
+				ringQueue(ring, RING_WRITE, fs->image_fd, get_block(fs, start) + done, piece, pos + done, NULL, 0);
+			}
+			addCount(&fs->counters.saved_bytes, len);
+			continue;
+		}
+		if(zero && punchHole(fs->image_fd, pos, len) == 0)
+		{
+			continue;
+		}
+		if(pwriteAll(fs->image_fd, get_block(fs, start), len, pos) < 0)
+		{
+			return -1;
+		}
+		addCount(&fs->counters.saved_bytes, len);
+	}
+	return ring ? ringFinish(ring) : 0;
+}
+
+// Helper function that hands len bytes of the mapping at p, widened to whole pages, to madvise
+static void adviseRange(mfs_t *fs, const uint8_t *p, size_t len, int advice)
+{
+	size_t page  = sysconf(_SC_PAGESIZE);
+	size_t start = (size_t)(p - fs->data) / page * page;
+	size_t end   = (size_t)(p - fs->data) + len;
+	if(end > fs->data_size)
+	{
+		end = fs->data_size;
+	}
+	if(end > start)
+	{
+		madvise(fs->data + start, end - start, advice);
+	}
+}
+
+// Helper function that records that the data blocks start through start + count - 1 are in the mapping,
+// as referenced if they were just read rather than just saved. Does nothing without a cache limit.
+static void noteCached(mfs_t *fs, int32_t start, int32_t count, int referenced)
+{
+	if(fs->cache_limit == 0 || count <= 0)
+	{
+		return;
+	}
+	if(start < fs->sb->first_data_block)
+	{
+		count -= fs->sb->first_data_block - start;
+		start  = fs->sb->first_data_block;
+	}
+
+	pthread_mutex_lock(&fs->cache_lock);
+	int32_t unit;
+	for(unit = start / fs->unit_blocks; count > 0 && unit <= (start + count - 1) / fs->unit_blocks; unit++)
+	{
+		if(!testBlock(fs->cached_units, unit))
+		{
+			fs->cached_units[unit / 64] |= 1ULL << (unit % 64);
+			fs->cache_count++;
+		}
+		if(referenced)
+		{
+			fs->referenced_units[unit / 64] |= 1ULL << (unit % 64);
+		}
+	}
+	pthread_mutex_unlock(&fs->cache_lock);
+}
+
+// Helper function that drops clean units from the mapping until the cache is back within its limit, or the
+// hand has been round twice without finding one. Only called where every change to the mapping has been
+// marked dirty, since a dropped unit comes back as the file holds it.
+static void trimCache(mfs_t *fs)
+{
+	if(fs->cache_limit == 0)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&fs->cache_lock);
+	int32_t units = (fs->sb->num_blocks + fs->unit_blocks - 1) / fs->unit_blocks;
+	int64_t steps;
+	for(steps = 0; fs->cache_count > fs->cache_limit && steps < 2 * (int64_t)units; steps++)
+	{
+		int32_t unit = fs->cache_hand;
+		fs->cache_hand = unit + 1 < units ? unit + 1 : 0;
+		if(!testBlock(fs->cached_units, unit))
+		{
+			continue;
+		}
+		if(testBlock(fs->referenced_units, unit))
+		{
+			fs->referenced_units[unit / 64] &= ~(1ULL << (unit % 64));
+			continue;
+		}
+
+		int32_t first = unit * fs->unit_blocks;
+		int32_t block;
+		for(block = first; block < first + fs->unit_blocks && block < fs->sb->num_blocks && !is_dirty(fs, block); block++)
+		{
+		}
+		if(block == first + fs->unit_blocks || block == fs->sb->num_blocks)
+		{
+			adviseRange(fs, get_block(fs, first), (size_t)fs->unit_blocks * fs->sb->block_size, MADV_DONTNEED);
+			fs->cached_units[unit / 64] &= ~(1ULL << (unit % 64));
+			fs->cache_count--;
+		}
+	}
+	pthread_mutex_unlock(&fs->cache_lock);
+}
+
+// Helper function that returns a word of the free map. With safe set, only the blocks that were free in the
+// last save as well are counted, which a crash in the middle of the next save cannot hurt by writing them
+// in place. Blocks freed since then may still hold a file the last save has, so they are used last.
+static uint64_t freeWord(mfs_t *fs, int32_t word, int safe)
+{
+	return safe ? fs->free_blocks[word] & fs->saved_free[word] : fs->free_blocks[word];
+}
+
+// Helper function that returns the index of a free block on success and -1 on failure, preferring
+// one that was free in the last save too. Scans the bitmap a word at a time starting from the hint,
+// wrapping around once.
+static int32_t findFreeBlock(mfs_t *fs)
+{
+	if(fs->free_block_count == 0)
+	{
+		return -1;
+	}
+
+	int32_t start = fs->free_block_hint / 64;
+	int     safe;
+	int32_t i;
+	for(safe = 1; safe >= 0; safe--)
+	{
+		for(i = 0; i < FREE_MAP_WORDS; i++)
+		{
+			int32_t  word = (start + i) % FREE_MAP_WORDS;
+			uint64_t bits = freeWord(fs, word, safe);
+			if(bits)
+			{
+				return word * 64 + __builtin_ctzll(bits);
+			}
+		}
+	}
+	return -1;
+}
+
+// Helper function that marks a free block as used by the image. The block itself counts as dirty even if
+// nothing is written to it, so the next save records its checksum.
+static void claimBlock(mfs_t *fs, int32_t block)
+{
+	if(fs->refcounts)
+	{
+		fs->refcounts[block] = 1;
+		mark_dirty(fs, &fs->refcounts[block], sizeof(uint16_t));
+	}
+	fs->free_blocks[block / 64] &= ~(1ULL << (block % 64));
+	fs->free_block_count--;
+	addCount(&fs->counters.blocks_allocated, 1);
+	fs->free_block_hint = block + 1 < fs->sb->num_blocks ? block + 1 : fs->sb->first_data_block;
+	fs->dirty_blocks[block / 64] |= 1ULL << (block % 64);
+	mark_dirty(fs, &fs->free_blocks[block / 64], sizeof(uint64_t));
+}
+
+// Helper function that drops one reference to a block, freeing it once nothing uses it
+static void releaseBlock(mfs_t *fs, int32_t block)
+{
+	if(fs->refcounts)
+	{
+		mark_dirty(fs, &fs->refcounts[block], sizeof(uint16_t));
+		if(fs->refcounts[block] > 1)
+		{
+			fs->refcounts[block]--;
+			return;
+		}
+		fs->refcounts[block] = 0;
+	}
+	if(fs->hashed_blocks)
+	{
+		fs->hashed_blocks[block / 64] &= ~(1ULL << (block % 64));
+	}
+	fs->freed_blocks[block / 64] |= 1ULL << (block % 64);
+	fs->free_blocks[block / 64] |= 1ULL << (block % 64);
+	fs->free_block_count++;
+	addCount(&fs->counters.blocks_freed, 1);
+	if(block < fs->free_block_hint)
+	{
+		fs->free_block_hint = block;
+	}
+	mark_dirty(fs, &fs->free_blocks[block / 64], sizeof(uint64_t));
+}
+
+// Helper function that recounts the free blocks of a freshly opened image
+static void countFreeBlocks(mfs_t *fs)
+{
+	int32_t i;
+	fs->free_block_count = 0;
+	for(i = 0; i < FREE_MAP_WORDS; i++)
+	{
+		fs->free_block_count += __builtin_popcountll(fs->free_blocks[i]);
+	}
+	fs->free_block_hint = fs->sb->first_data_block;
+}
+
+// Helper function that hashes a filename (FNV-1a) for the name index
+static uint32_t hashName(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+	for(i = 0; i < 64 && name[i]; i++)
+	{
+		hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Helper function that returns the directory index of the file with the given name whose in_use
+// flag matches in_use, or -1 if there is none
+static int32_t findFile(mfs_t *fs, const char *name, short in_use)
+{
+	if(!fs->name_index)
+	{
+		return -1;
+	}
+
+	uint32_t slot = hashName(name) & (fs->name_index_size - 1);
+	addCount(&fs->counters.lookups, 1);
+
+	while(fs->name_index[slot] != -1)
+	{
+		struct directoryEntry *entry = &fs->directory[fs->name_index[slot]];
+		if(entry->in_use == in_use && strncmp(entry->filename, name, 64) == 0)
+		{
+			return fs->name_index[slot];
+		}
+		slot = (slot + 1) & (fs->name_index_size - 1);
+	}
+	return -1;
+}
+
+// Helper function that adds a directory entry to the name index
+static void indexName(mfs_t *fs, int32_t entry)
+{
+	uint32_t slot = hashName(fs->directory[entry].filename) & (fs->name_index_size - 1);
+
+	while(fs->name_index[slot] != -1)
+	{
+		slot = (slot + 1) & (fs->name_index_size - 1);
+	}
+	fs->name_index[slot] = entry;
+}
+
+// Helper function that removes a directory entry from the name index, shifting later
+// members of its probe chain back so lookups never need tombstones
+static void unindexName(mfs_t *fs, int32_t entry)
+{
+	uint32_t mask = fs->name_index_size - 1;
+	uint32_t hole = hashName(fs->directory[entry].filename) & mask;
+
+	while(fs->name_index[hole] != entry)
+	{
+		if(fs->name_index[hole] == -1)
+		{
+			return;
+		}
+		hole = (hole + 1) & mask;
+	}
+
+	uint32_t next = (hole + 1) & mask;
+	while(fs->name_index[next] != -1)
+	{
+		uint32_t home = hashName(fs->directory[fs->name_index[next]].filename) & mask;
+		if(((next - home) & mask) >= ((next - hole) & mask))
+		{
+			fs->name_index[hole] = fs->name_index[next];
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+	fs->name_index[hole] = -1;
+}
+
+// Helper function that rebuilds the name index from the directory of a newly opened image
+static void rebuildNameIndex(mfs_t *fs)
+{
+	int32_t i;
+	memset(fs->name_index, 0xff, fs->name_index_size * sizeof(int32_t));
+
+	for(i = 0; i < fs->sb->num_files; i++)
+	{
+		if(fs->directory[i].filename[0])
+		{
+			indexName(fs, i);
+		}
+	}
+}
+
+// Helper function that claims a free block for use as an indirect or double-indirect block and
+// fills it with empty extents (extents is 1) or -1 pointers (extents is 0). Returns -1 if the disk is full
+static int32_t allocateMapBlock(mfs_t *fs, int extents)
+{
+	int32_t block = findFreeBlock(fs);
+	if(block == -1)
+	{
+		return -1;
+	}
+	claimBlock(fs, block);
+
+	if(extents)
+	{
+		struct extent *list = (struct extent *)get_block(fs, block);
+		int i;
+		for(i = 0; i < EXTENTS_PER_BLOCK; i++)
+		{
+			list[i].start  = -1;
+			list[i].length = 0;
+		}
+	}
+	else
+	{
+		memset(get_block(fs, block), 0xff, fs->sb->block_size);
+	}
+	mark_dirty(fs, get_block(fs, block), fs->sb->block_size);
+	return block;
+}
+
+// Helper function that returns a pointer to extent number n of an inode. If the indirect block
+// that would hold it does not exist, it is allocated when allocate is 1, otherwise NULL is returned.
+// NULL is also returned past EXTENTS_PER_FILE or when the disk is full.
+static struct extent *getExtent(mfs_t *fs, struct inode *inode_ptr, int32_t n, int allocate)
+{
+	if(n < DIRECT_EXTENTS)
+	{
+		return &inode_ptr->extents[n];
+	}
+
+	n -= DIRECT_EXTENTS;
+	if(n < EXTENTS_PER_BLOCK)
+	{
+		if(inode_ptr->indirect == -1)
+		{
+			if(!allocate || (inode_ptr->indirect = allocateMapBlock(fs, 1)) == -1)
+			{
+				return NULL;
+			}
+			mark_dirty(fs, inode_ptr, sizeof(struct inode));
+		}
+		return &((struct extent *)get_block(fs, inode_ptr->indirect))[n];
+	}
+
+	n -= EXTENTS_PER_BLOCK;
+	if(n >= POINTERS_PER_BLOCK * EXTENTS_PER_BLOCK)
+	{
+		return NULL;
+	}
+
+	if(inode_ptr->double_indirect == -1)
+	{
+		if(!allocate || (inode_ptr->double_indirect = allocateMapBlock(fs, 0)) == -1)
+		{
+			return NULL;
+		}
+		mark_dirty(fs, inode_ptr, sizeof(struct inode));
+	}
+
+	int32_t *pointer = &((int32_t *)get_block(fs, inode_ptr->double_indirect))[n / EXTENTS_PER_BLOCK];
+	if(*pointer == -1)
+	{
+		if(!allocate || (*pointer = allocateMapBlock(fs, 1)) == -1)
+		{
+			return NULL;
+		}
+		mark_dirty(fs, pointer, sizeof(int32_t));
+	}
+	return &((struct extent *)get_block(fs, *pointer))[n % EXTENTS_PER_BLOCK];
+}
+
+// Helper function that returns the number of extents in use by an inode, which is also the
+// slot the next extent goes in
+static int32_t countExtents(mfs_t *fs, struct inode *inode_ptr)
+{
+	int32_t n = 0;
+	struct extent *ext;
+
+	while((ext = getExtent(fs, inode_ptr, n, 0)) && ext->length)
+	{
+		n++;
+	}
+	return n;
+}
+
+// Helper function that empties the extent list of an inode that is being reused. The blocks
+// it pointed at were already released when the previous file was deleted.
+static void resetExtents(mfs_t *fs, struct inode *inode_ptr)
+{
+	int i;
+	for(i = 0; i < DIRECT_EXTENTS; i++)
+	{
+		inode_ptr->extents[i].start  = -1;
+		inode_ptr->extents[i].length = 0;
+	}
+	inode_ptr->indirect        = -1;
+	inode_ptr->double_indirect = -1;
+	inode_ptr->file_size       = 0;
+	mark_dirty(fs, inode_ptr, sizeof(struct inode));
+}
+
+// Helper function that returns the first block at or after from that is free (when free is 1)
+// or not (when free is 0), or the number of blocks if there is none. With safe set, only blocks
+// that were free in the last save too count as free.
+static int32_t nextBlockIn(mfs_t *fs, int32_t from, int free, int safe)
+{
+	if(from >= fs->sb->num_blocks)
+	{
+		return fs->sb->num_blocks;
+	}
+
+	int32_t  word = from / 64;
+	uint64_t bits = (free ? freeWord(fs, word, safe) : ~freeWord(fs, word, safe)) & (~0ULL << (from % 64));
+	while(bits == 0)
+	{
+		if(++word == FREE_MAP_WORDS)
+		{
+			return fs->sb->num_blocks;
+		}
+		bits = free ? freeWord(fs, word, safe) : ~freeWord(fs, word, safe);
+	}
+
+	// the unused tail of the last word reads as in use
+	int32_t block = word * 64 + __builtin_ctzll(bits);
+	return block < fs->sb->num_blocks ? block : fs->sb->num_blocks;
+}
+
+// Helper function that finds the smallest run of free blocks holding at least wanted blocks, or the
+// largest run if none is big enough. Blocks that were free in the last save too are used up before
+// any that were not. Returns the start of the run and stores its length in length, or returns -1
+// if no blocks are free
+static int32_t findFreeRun(mfs_t *fs, int32_t wanted, int32_t *length)
+{
+	int32_t best = -1;
+	int32_t best_length = 0;
+	int     safe;
+
+	for(safe = 1; safe >= 0 && best == -1; safe--)
+	{
+		int32_t start = nextBlockIn(fs, fs->sb->first_data_block, 1, safe);
+		while(start < fs->sb->num_blocks)
+		{
+			int32_t end = nextBlockIn(fs, start, 0, safe);
+			int32_t run = end - start;
+
+			if(best == -1 ||
+			   (run >= wanted && (best_length < wanted || run < best_length)) ||
+			   (run < wanted && best_length < wanted && run > best_length))
+			{
+				best = start;
+				best_length = run;
+				if(run == wanted)
+				{
+					break;
+				}
+			}
+			start = nextBlockIn(fs, end, 1, safe);
+		}
+	}
+
+	*length = best_length;
+	return best;
+}
+
+// Helper function that returns 1 if a block of a deleted file can be given back to it: either it is free,
+// or another file or snapshot sharing it has kept it in use ever since the delete. A block that dropped to
+// no references since the last open shows up in freed_blocks, so one taken again by a new file does not pass.
+static int canReclaimBlock(mfs_t *fs, int32_t block)
+{
+	uint64_t bit = 1ULL << (block % 64);
+	if(fs->free_blocks[block / 64] & bit)
+	{
+		return 1;
+	}
+	return fs->refcounts && fs->refcounts[block] && !(fs->freed_blocks[block / 64] & bit);
+}
+
+// Helper function that returns 1 if every block of a deleted file, including its indirect blocks, can be
+// given back to it. The indirect blocks are checked before anything is read out of them.
+static int canReclaimExtents(mfs_t *fs, struct inode *inode_ptr)
+{
+	if(inode_ptr->indirect != -1 && !canReclaimBlock(fs, inode_ptr->indirect))
+	{
+		return 0;
+	}
+	if(inode_ptr->double_indirect != -1)
+	{
+		if(!canReclaimBlock(fs, inode_ptr->double_indirect))
+		{
+			return 0;
+		}
+
+		int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+		int i;
+		for(i = 0; i < POINTERS_PER_BLOCK && pointers[i] != -1; i++)
+		{
+			if(!canReclaimBlock(fs, pointers[i]))
+			{
+				return 0;
+			}
+		}
+	}
+
+	int32_t i;
+	struct extent *ext;
+	for(i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+	{
+		int32_t j;
+		for(j = 0; j < ext->length; j++)
+		{
+			if(!canReclaimBlock(fs, ext->start + j))
+			{
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+// Helper function that claims (claim is 1) or releases (claim is 0) a single block. A block that is
+// still in use is shared, so claiming it adds a reference instead.
+static void setBlockUsed(mfs_t *fs, int32_t block, int claim)
+{
+	if(claim && !(fs->free_blocks[block / 64] & (1ULL << (block % 64))))
+	{
+		fs->refcounts[block]++;
+		mark_dirty(fs, &fs->refcounts[block], sizeof(uint16_t));
+	}
+	else if(claim)
+	{
+		claimBlock(fs, block);
+	}
+	else
+	{
+		releaseBlock(fs, block);
+	}
+}
+
+// Helper function that marks every block of a file, including its indirect blocks, as used (claim is 1)
+// or free (claim is 0). The extent list itself is left alone so a deleted file can still be undeleted.
+static void setExtentsUsed(mfs_t *fs, struct inode *inode_ptr, int claim)
+{
+	int32_t i;
+	struct extent *ext;
+	for(i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+	{
+		int32_t j;
+		for(j = 0; j < ext->length; j++)
+		{
+			setBlockUsed(fs, ext->start + j, claim);
+		}
+	}
+
+	if(inode_ptr->indirect != -1)
+	{
+		setBlockUsed(fs, inode_ptr->indirect, claim);
+	}
+	if(inode_ptr->double_indirect != -1)
+	{
+		int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+		for(i = 0; i < POINTERS_PER_BLOCK && pointers[i] != -1; i++)
+		{
+			setBlockUsed(fs, pointers[i], claim);
+		}
+		setBlockUsed(fs, inode_ptr->double_indirect, claim);
+	}
+}
+
+// Helper function that returns how many indirect blocks hold a file's extent list
+static int32_t countMapBlocks(mfs_t *fs, struct inode *inode_ptr)
+{
+	int32_t count = inode_ptr->indirect != -1;
+	if(inode_ptr->double_indirect != -1)
+	{
+		int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+		int32_t i;
+		for(i = 0; i < POINTERS_PER_BLOCK && pointers[i] != -1; i++)
+		{
+			count++;
+		}
+		count++;
+	}
+	return count;
+}
+
+// Helper function that releases the indirect blocks of a file and empties its extent list without
+// touching the data blocks, which the caller is handing on
+static void releaseMapBlocks(mfs_t *fs, struct inode *inode_ptr)
+{
+	if(inode_ptr->double_indirect != -1)
+	{
+		int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+		int32_t i;
+		for(i = 0; i < POINTERS_PER_BLOCK && pointers[i] != -1; i++)
+		{
+			releaseBlock(fs, pointers[i]);
+		}
+		releaseBlock(fs, inode_ptr->double_indirect);
+	}
+	if(inode_ptr->indirect != -1)
+	{
+		releaseBlock(fs, inode_ptr->indirect);
+	}
+
+	uint32_t file_size = inode_ptr->file_size;
+	resetExtents(fs, inode_ptr);
+	inode_ptr->file_size = file_size;
+}
+
+// Helper function that returns how many indirect blocks an extent list of extents extents needs
+static int32_t mapBlocksFor(mfs_t *fs, int32_t extents)
+{
+	if(extents <= DIRECT_EXTENTS)
+	{
+		return 0;
+	}
+	extents -= DIRECT_EXTENTS;
+	if(extents <= EXTENTS_PER_BLOCK)
+	{
+		return 1;
+	}
+	extents -= EXTENTS_PER_BLOCK;
+	return 2 + (extents + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+}
+
+// Helper function that releases extent number keep and everything after it, along with any
+// indirect blocks that only held those extents
+static void truncateExtents(mfs_t *fs, struct inode *inode_ptr, int32_t keep)
+{
+	int32_t i;
+	struct extent *ext;
+	for(i = keep; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+	{
+		int32_t j;
+		for(j = 0; j < ext->length; j++)
+		{
+			releaseBlock(fs, ext->start + j);
+		}
+		ext->start  = -1;
+		ext->length = 0;
+		mark_dirty(fs, ext, sizeof(struct extent));
+	}
+
+	if(inode_ptr->double_indirect != -1)
+	{
+		int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+		int32_t first = DIRECT_EXTENTS + EXTENTS_PER_BLOCK;
+		for(i = 0; i < POINTERS_PER_BLOCK && pointers[i] != -1; i++)
+		{
+			if(first + i * EXTENTS_PER_BLOCK >= keep)
+			{
+				releaseBlock(fs, pointers[i]);
+				pointers[i] = -1;
+				mark_dirty(fs, &pointers[i], sizeof(int32_t));
+			}
+		}
+		if(first >= keep)
+		{
+			releaseBlock(fs, inode_ptr->double_indirect);
+			inode_ptr->double_indirect = -1;
+		}
+	}
+	if(inode_ptr->indirect != -1 && DIRECT_EXTENTS >= keep)
+	{
+		releaseBlock(fs, inode_ptr->indirect);
+		inode_ptr->indirect = -1;
+	}
+	mark_dirty(fs, inode_ptr, sizeof(struct inode));
+}
+
+// Helper function that releases every block of a file after its first blocks blocks
+static void shrinkFile(mfs_t *fs, struct inode *inode_ptr, int32_t blocks)
+{
+	int32_t i;
+	struct extent *ext;
+	for(i = 0; blocks > 0 && (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+	{
+		if(ext->length > blocks)
+		{
+			int32_t j;
+			for(j = blocks; j < ext->length; j++)
+			{
+				releaseBlock(fs, ext->start + j);
+			}
+			ext->length = blocks;
+			mark_dirty(fs, ext, sizeof(struct extent));
+		}
+		blocks -= ext->length;
+	}
+	truncateExtents(fs, inode_ptr, i);
+}
+
+// Helper function that appends extents totalling required_blocks to an inode, preferring the
+// best-fitting contiguous run. Returns 0 on success and -1 if the blocks could not be found, in
+// which case nothing is allocated
+static int allocateExtents(mfs_t *fs, int32_t inode, int32_t required_blocks)
+{
+	struct inode *inode_ptr = &fs->inodes[inode];
+	int32_t first = countExtents(fs, inode_ptr);
+	int32_t slot  = first;
+
+	while(required_blocks > 0)
+	{
+		int32_t length;
+		int32_t start = findFreeRun(fs, required_blocks, &length);
+		struct extent *ext = NULL;
+
+		if(start != -1)
+		{
+			if(length > required_blocks)
+			{
+				length = required_blocks;
+			}
+
+			// claim the run before the extent slot, which may itself need a fresh indirect block
+			int32_t j;
+			for(j = 0; j < length; j++)
+			{
+				claimBlock(fs, start + j);
+			}
+
+			ext = getExtent(fs, inode_ptr, slot, 1);
+			if(!ext)
+			{
+				for(j = 0; j < length; j++)
+				{
+					releaseBlock(fs, start + j);
+				}
+			}
+		}
+
+		if(!ext)
+		{
+			// give back whatever we managed to take
+			truncateExtents(fs, inode_ptr, first);
+			return -1;
+		}
+
+		ext->start  = start;
+		ext->length = length;
+		mark_dirty(fs, ext, sizeof(struct extent));
+
+		required_blocks -= length;
+		slot++;
+	}
+
+	return 0;
+}
+
+// Helper function that returns the number of blocks needed to hold bytes bytes
+static int32_t blocksFor(size_t bytes, int32_t block_size)
+{
+	return (int32_t)((bytes + block_size - 1) / block_size);
+}
+
+// Helper function that fills in the region offsets of a superblock from its geometry.
+// Returns 0 on success and -1 if the metadata would not leave room for any data.
+static int layoutImage(struct superblock *super)
+{
+	super->directory_block  = 1;
+	super->free_inode_block = super->directory_block + blocksFor((size_t)super->num_files * sizeof(struct directoryEntry), super->block_size);
+	super->inode_block      = super->free_inode_block + blocksFor(super->num_files, super->block_size);
+	super->free_map_block   = super->inode_block + blocksFor((size_t)super->num_files * sizeof(struct inode), super->block_size);
+	super->refcount_block   = super->free_map_block + blocksFor((super->num_blocks + 63) / 64 * sizeof(uint64_t), super->block_size);
+	super->snapshot_block   = super->refcount_block + blocksFor((size_t)super->num_blocks * sizeof(uint16_t), super->block_size);
+	super->checksum_block   = super->snapshot_block + blocksFor(MAX_SNAPSHOTS * sizeof(struct snapshotEntry), super->block_size);
+	super->journal_block    = super->checksum_block + blocksFor((size_t)super->num_blocks * sizeof(uint32_t), super->block_size);
+
+	// the journal can hold every metadata block at once, so a save that only changes metadata never
+	// has to write anything in place unprotected
+	int32_t capacity = super->journal_block + (super->num_blocks / JOURNAL_DATA_SHARE < MAX_JOURNAL_DATA ?
+	                                           super->num_blocks / JOURNAL_DATA_SHARE : MAX_JOURNAL_DATA);
+	super->journal_blocks   = 1 + blocksFor((size_t)capacity * sizeof(int32_t), super->block_size) + capacity;
+	super->first_data_block = super->journal_block + super->journal_blocks;
+
+	// images too small for a journal do without one
+	if(super->first_data_block >= super->num_blocks)
+	{
+		super->first_data_block = super->journal_block;
+		super->journal_block    = 0;
+		super->journal_blocks   = 0;
+	}
+
+	return super->first_data_block < super->num_blocks ? 0 : -1;
+}
+
+// Helper function that returns 1 if block_size is a power of two we support
+static int validBlockSize(int32_t block_size)
+{
+	return block_size >= MFS_MIN_BLOCK_SIZE && block_size <= MFS_MAX_BLOCK_SIZE && (block_size & (block_size - 1)) == 0;
+}
+
+// Helper function that returns 1 if the superblock of a mapped image of size bytes describes
+// regions that are in order, large enough and inside the file
+static int validSuperblock(mfs_t *fs, size_t size)
+{
+	struct superblock *sb = fs->sb;
+
+	if(size < sizeof(struct superblock) || sb->magic != MFS_MAGIC || !validBlockSize(sb->block_size) ||
+	   sb->num_blocks <= 0 || sb->num_files <= 0 || (size_t)sb->num_blocks * sb->block_size > size)
+	{
+		return 0;
+	}
+
+	if(sb->directory_block < 1 ||
+	   sb->free_inode_block < sb->directory_block + blocksFor((size_t)sb->num_files * sizeof(struct directoryEntry), sb->block_size) ||
+	   sb->inode_block < sb->free_inode_block + blocksFor(sb->num_files, sb->block_size) ||
+	   sb->free_map_block < sb->inode_block + blocksFor((size_t)sb->num_files * sizeof(struct inode), sb->block_size))
+	{
+		return 0;
+	}
+
+	// the regions after the free map are optional, but each that is there must follow the last
+	int32_t end = sb->free_map_block + blocksFor(FREE_MAP_WORDS * sizeof(uint64_t), sb->block_size);
+	if(sb->refcount_block != 0)
+	{
+		if(sb->refcount_block < end || sb->snapshot_block < sb->refcount_block + blocksFor((size_t)sb->num_blocks * sizeof(uint16_t), sb->block_size))
+		{
+			return 0;
+		}
+		end = sb->snapshot_block + blocksFor(MAX_SNAPSHOTS * sizeof(struct snapshotEntry), sb->block_size);
+	}
+	if(sb->checksum_block != 0)
+	{
+		if(sb->refcount_block == 0 || sb->checksum_block < end)
+		{
+			return 0;
+		}
+		end = sb->checksum_block + blocksFor((size_t)sb->num_blocks * sizeof(uint32_t), sb->block_size);
+	}
+	if(sb->journal_blocks != 0)
+	{
+		if(sb->journal_blocks < 2 || sb->journal_block < end)
+		{
+			return 0;
+		}
+		end = sb->journal_block + sb->journal_blocks;
+	}
+	return sb->first_data_block >= end && sb->first_data_block < sb->num_blocks;
+}
+
+// Helper function that returns how many blocks one transaction can hold in the journal of sb: the
+// header block comes first, then one descriptor block per block_size / 4 journaled blocks, then the blocks
+static int32_t journalCapacity(const struct superblock *sb)
+{
+	int64_t per_descriptor = sb->block_size / sizeof(int32_t);
+	return sb->journal_blocks < 2 ? 0 : (int32_t)((sb->journal_blocks - 1) * per_descriptor / (per_descriptor + 1));
+}
+
+// Helper function that writes all len bytes of buf to fd. Returns 0 on success and -1 on failure
+static int writeAll(int fd, const uint8_t *buf, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t written = write(fd, buf, len);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buf += written;
+		len -= written;
+	}
+	return 0;
+}
+
+// Helper function that copies len bytes at offset pos of the image file to out_fd without passing
+// them through user space, using copy_file_range and falling back to sendfile when the kernel or
+// file systems can't do that. Returns the number of bytes copied, which is short if both fail
+static size_t kernelCopy(mfs_t *fs, int out_fd, off_t pos, size_t len)
+{
+	size_t done = 0;
+	int    use_sendfile = 0;
+
+	while(done < len)
+	{
+		ssize_t copied = use_sendfile ? sendfile(out_fd, fs->image_fd, &pos, len - done)
+		                               : copy_file_range(fs->image_fd, &pos, out_fd, NULL, len - done, 0);
+		if(copied < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(copied <= 0)
+		{
+			if(use_sendfile)
+			{
+				break;
+			}
+			use_sendfile = 1;
+			continue;
+		}
+		done += copied;
+	}
+	return done;
+}
+
+// Helper function that writes bytes bytes of the image starting at block start to out_fd.
+// Blocks that match the image file are copied by the kernel; blocks with unsaved changes only
+// exist in our mapping and are written from there. Returns 0 on success and -1 on failure
+static int copyBlocksOut(mfs_t *fs, int out_fd, int32_t start, size_t bytes)
+{
+	while(bytes > 0)
+	{
+		int    dirty = is_dirty(fs, start);
+		size_t run   = 0;
+		while(run < bytes && is_dirty(fs, start + run / fs->sb->block_size) == dirty)
+		{
+			run += fs->sb->block_size;
+		}
+		if(run > bytes)
+		{
+			run = bytes;
+		}
+
+		size_t done = dirty ? 0 : kernelCopy(fs, out_fd, (off_t)start * fs->sb->block_size, run);
+		if(done < run && writeAll(out_fd, get_block(fs, start) + done, run - done) < 0)
+		{
+			return -1;
+		}
+
+		start += run / fs->sb->block_size;
+		bytes -= run;
+	}
+	return 0;
+}
+
+// Helper function that maps size bytes of the image open on image_fd. The superblock is
+// then readable through sb. Returns 0 on success and -1 on failure
+static int map_image(mfs_t *fs, size_t size)
+{
+	void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fs->image_fd, 0);
+	if(addr == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	fs->data      = (uint8_t *)addr;
+	fs->data_size = size;
+	fs->sb        = (struct superblock *)fs->data;
+	return 0;
+}
+
+// Helper function that points the metadata regions into the mapping using the geometry in the
+// superblock and sizes the in-memory tables to match. Returns 0 on success and -1 on failure
+static int attach_regions(mfs_t *fs)
+{
+	fs->dirty_blocks = calloc(FREE_MAP_WORDS, sizeof(uint64_t));
+	fs->saved_free   = calloc(FREE_MAP_WORDS, sizeof(uint64_t));
+	fs->freed_blocks = calloc(FREE_MAP_WORDS, sizeof(uint64_t));
+
+	fs->name_index_size = 1;
+	while(fs->name_index_size < 2 * (uint32_t)fs->sb->num_files)
+	{
+		fs->name_index_size <<= 1;
+	}
+	fs->name_index = malloc(fs->name_index_size * sizeof(int32_t));
+
+	if(!fs->dirty_blocks || !fs->saved_free || !fs->freed_blocks || !fs->name_index)
+	{
+		return -1;
+	}
+	memset(fs->name_index, 0xff, fs->name_index_size * sizeof(int32_t));
+
+	fs->directory   = (struct directoryEntry*)get_block(fs, fs->sb->directory_block);
+	fs->inodes      = (struct inode*)get_block(fs, fs->sb->inode_block);
+	fs->free_blocks = (uint64_t *)get_block(fs, fs->sb->free_map_block);
+	fs->free_inodes = (uint8_t *)get_block(fs, fs->sb->free_inode_block);
+	if(fs->sb->refcount_block != 0)
+	{
+		fs->refcounts = (uint16_t *)get_block(fs, fs->sb->refcount_block);
+		fs->snapshots = (struct snapshotEntry *)get_block(fs, fs->sb->snapshot_block);
+	}
+	if(fs->sb->checksum_block != 0)
+	{
+		fs->checksums       = (uint32_t *)get_block(fs, fs->sb->checksum_block);
+		fs->verified_blocks = calloc(FREE_MAP_WORDS, sizeof(uint64_t));
+		if(!fs->verified_blocks)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Helper function that releases the mapping, descriptor and in-memory tables of the current image, if any
+static void unmap_image(mfs_t *fs)
+{
+	if(fs->data)
+	{
+		munmap(fs->data, fs->data_size);
+	}
+	if(fs->image_fd >= 0)
+	{
+		close(fs->image_fd);
+	}
+	free(fs->dirty_blocks);
+	free(fs->saved_free);
+	free(fs->freed_blocks);
+	free(fs->name_index);
+	free(fs->block_index);
+	free(fs->hashed_blocks);
+	free(fs->verified_blocks);
+	free(fs->cached_units);
+	free(fs->referenced_units);
+
+	fs->data              = NULL;
+	fs->data_size         = 0;
+	fs->sb                = NULL;
+	fs->dirty_blocks      = NULL;
+	fs->saved_free        = NULL;
+	fs->freed_blocks      = NULL;
+	fs->name_index        = NULL;
+	fs->directory         = NULL;
+	fs->inodes            = NULL;
+	fs->free_blocks       = NULL;
+	fs->free_inodes       = NULL;
+	fs->refcounts         = NULL;
+	fs->snapshots         = NULL;
+	fs->block_index       = NULL;
+	fs->hashed_blocks     = NULL;
+	fs->checksums         = NULL;
+	fs->verified_blocks   = NULL;
+	fs->cached_units      = NULL;
+	fs->referenced_units  = NULL;
+	fs->cache_limit       = 0;
+	fs->cache_count       = 0;
+	fs->block_index_size  = 0;
+	fs->block_index_count = 0;
+	fs->image_fd          = -1;
+}
+
+// Helper function that folds len bytes into a running FNV-1a checksum, which starts at CHECKSUM_SEED
+static uint32_t checksum(uint32_t sum, const uint8_t *buf, size_t len)
+{
+	size_t i;
+	for(i = 0; i < len; i++)
+	{
+		sum = (sum ^ buf[i]) * 16777619u;
+	}
+	return sum;
+}
+
+// CRC32C lookup tables for the slicing-by-8 fallback, built once by initCrc: crc_table[k][b] is the CRC of byte b
+// followed by k zero bytes
+static uint32_t       crc_table[8][256];
+static int            crc_hardware;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// Helper function that builds the CRC32C tables and checks whether the CPU has the SSE4.2 crc32 instruction
+static void initCrc(void)
+{
+	int i, k;
+	for(i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for(k = 0; k < 8; k++)
+		{
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc_table[0][i] = crc;
+	}
+	for(i = 0; i < 256; i++)
+	{
+		for(k = 1; k < 8; k++)
+		{
+			crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+		}
+	}
+#if defined(__x86_64__)
+	crc_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+// Helper function that folds len bytes into a CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crcHardware(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64 = crc;
+	for(; len >= 8; p += 8, len -= 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+	crc = (uint32_t)crc64;
+	for(; len > 0; p++, len--)
+	{
+		crc = __builtin_ia32_crc32qi(crc, *p);
+	}
+	return crc;
+}
+#endif
+
+// Helper function that returns the CRC32C of len bytes, using the crc32 instruction when the CPU has one
+static uint32_t crc32c(const uint8_t *p, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+
+	pthread_once(&crc_once, initCrc);
+#if defined(__x86_64__)
+	if(crc_hardware)
+	{
+		return ~crcHardware(crc, p, len);
+	}
+#endif
+	for(; len >= 8; p += 8, len -= 8)
+	{
+		uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+		      crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+	}
+	for(; len > 0; p++, len--)
+	{
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xff];
+	}
+	return ~crc;
+}
+
+// Helper function that returns 1 if block has a checksum, which every block outside the checksum region and the
+// journal does once the image has them
+static int hasChecksum(mfs_t *fs, int32_t block)
+{
+	int32_t checksum_end = fs->sb->checksum_block + blocksFor((size_t)fs->sb->num_blocks * sizeof(uint32_t), fs->sb->block_size);
+	return fs->checksums && (block < fs->sb->checksum_block || block >= checksum_end) &&
+	       (fs->sb->journal_blocks == 0 || block < fs->sb->journal_block || block >= fs->sb->journal_block + fs->sb->journal_blocks);
+}
+
+// Helper function that checks blocks start through start + count - 1 against their checksums, skipping any
+// checked already or changed since the last save. Readers share the handle, so the verified bits are set
+// atomically. Returns 0 if they all match and -EIO if one does not.
+static int verifyBlocks(mfs_t *fs, int32_t start, int32_t count)
+{
+	int32_t block;
+	for(block = start; fs->checksums && block < start + count; block++)
+	{
+		if(testBlock(fs->verified_blocks, block) || is_dirty(fs, block) || !hasChecksum(fs, block))
+		{
+			continue;
+		}
+		if(crc32c(get_block(fs, block), fs->sb->block_size) != fs->checksums[block])
+		{
+			return -EIO;
+		}
+		__atomic_fetch_or(&fs->verified_blocks[block / 64], 1ULL << (block % 64), __ATOMIC_RELAXED);
+		noteCached(fs, block, 1, 1);
+	}
+	return 0;
+}
+
+// Helper function that checks the blocks overlapping [ptr, ptr + len) of the mapping like verifyBlocks
+static int verifyBytes(mfs_t *fs, const void *ptr, size_t len)
+{
+	size_t offset = (const uint8_t *)ptr - fs->data;
+	int32_t first = offset / fs->sb->block_size;
+	return len ? verifyBlocks(fs, first, (offset + len - 1) / fs->sb->block_size - first + 1) : 0;
+}
+
+// Helper function that checks the metadata regions and the indirect blocks of every file, which everything
+// else relies on. Returns 0 if they all match their checksums and -EIO if one does not.
+static int verifyMetadata(mfs_t *fs)
+{
+	int32_t i, j;
+
+	if(verifyBlocks(fs, 0, fs->sb->first_data_block) < 0)
+	{
+		return -EIO;
+	}
+	for(i = 0; i < fs->sb->num_files; i++)
+	{
+		struct inode *inode_ptr = &fs->inodes[i];
+		if(!inode_ptr->in_use)
+		{
+			continue;
+		}
+		if((inode_ptr->indirect != -1 && verifyBlocks(fs, inode_ptr->indirect, 1) < 0) ||
+		   (inode_ptr->double_indirect != -1 && verifyBlocks(fs, inode_ptr->double_indirect, 1) < 0))
+		{
+			return -EIO;
+		}
+		if(inode_ptr->double_indirect != -1)
+		{
+			int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+			for(j = 0; j < POINTERS_PER_BLOCK && pointers[j] != -1; j++)
+			{
+				if(verifyBlocks(fs, pointers[j], 1) < 0)
+				{
+					return -EIO;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+// Helper function that brings the checksums of the blocks about to be saved up to date. Those blocks then match
+// what the file will hold, so they count as verified.
+static void updateChecksums(mfs_t *fs)
+{
+	int32_t i;
+	for(i = 0; fs->checksums && i < FREE_MAP_WORDS; i++)
+	{
+		uint64_t dirty = fs->dirty_blocks[i];
+		while(dirty)
+		{
+			int32_t block = i * 64 + __builtin_ctzll(dirty);
+			dirty &= dirty - 1;
+			if(!hasChecksum(fs, block))
+			{
+				continue;
+			}
+
+			uint32_t crc = crc32c(get_block(fs, block), fs->sb->block_size);
+			if(crc != fs->checksums[block])
+			{
+				fs->checksums[block] = crc;
+				mark_dirty(fs, &fs->checksums[block], sizeof(uint32_t));
+			}
+		}
+		fs->verified_blocks[i] |= fs->dirty_blocks[i];
+	}
+}
+
+// Helper function that writes the journal header of the image open on fd. Returns 0 on success and -1 on failure
+static int writeJournalHeader(int fd, const struct superblock *sb, int32_t count, uint32_t sum)
+{
+	struct journalHeader header = { JOURNAL_MAGIC, count, sum };
+	return pwriteAll(fd, &header, sizeof(header), (off_t)sb->journal_block * sb->block_size);
+}
+
+// Helper function that adds a dirty block to the transaction being built if the last save's image uses it
+// and the journal has room. Blocks the image does not use yet can safely be written in place instead.
+static void journalBlock(mfs_t *fs, uint64_t *journaled, int32_t *targets, int32_t *count, int32_t capacity, int32_t block)
+{
+	if(*count < capacity && testBlock(fs->dirty_blocks, block) && !testBlock(fs->saved_free, block) &&
+	   !testBlock(journaled, block))
+	{
+		journaled[block / 64] |= 1ULL << (block % 64);
+		targets[(*count)++] = block;
+	}
+}
+
+// Helper function that writes the blocks listed in targets one after another starting at pos, JOURNAL_IOVECS
+// blocks per pwritev, or per ring request so that they are all written at once. Returns 0 on success and -1 on failure
+static int writeJournalBlocks(mfs_t *fs, const int32_t *targets, int32_t count, off_t pos)
+{
+	struct iovec   iov[JOURNAL_IOVECS];
+	struct ioRing *ring = handleRing(fs);
+	size_t block_size = fs->sb->block_size;
+	int32_t done = 0;
+
+	while(done < count)
+	{
+		int n = count - done < JOURNAL_IOVECS ? count - done : JOURNAL_IOVECS;
+		int i;
+		for(i = 0; i < n; i++)
+		{
+			iov[i].iov_base = get_block(fs, targets[done + i]);
+			iov[i].iov_len  = block_size;
+		}
+		if(ring)
+		{
+			ringQueue(ring, RING_WRITEV, fs->image_fd, NULL, n * block_size, pos, iov, n);
+			done += n;
+			pos  += (off_t)n * block_size;
+			addCount(&fs->counters.saved_bytes, (uint64_t)n * block_size);
+			continue;
+		}
+
+		ssize_t written = pwritev(fs->image_fd, iov, n, pos);
+		if(written != (ssize_t)(n * block_size))
+		{
+			if(written < 0 && errno != EINTR)
+			{
+				return -1;
+			}
+			// finish a short or interrupted batch a block at a time
+			for(i = 0; i < n; i++)
+			{
+				if(pwriteAll(fs->image_fd, iov[i].iov_base, block_size, pos + (off_t)i * block_size) < 0)
+				{
+					return -1;
+				}
+			}
+		}
+		done += n;
+		pos  += (off_t)n * block_size;
+		addCount(&fs->counters.saved_bytes, (uint64_t)n * block_size);
+	}
+	return ring ? ringFinish(ring) : 0;
+}
+
+// Helper function that returns 1 if a save has to take block through the journal, because it has changed
+// and the last save's image uses it
+static int needsJournal(mfs_t *fs, int32_t block)
+{
+	return testBlock(fs->dirty_blocks, block) && !testBlock(fs->saved_free, block);
+}
+
+// Helper function that returns the blocks of word of the maps that were freed since the last save and have
+// been taken again. The last save still gives them to whatever had them then, usually a deleted file, so
+// writing one in place could leave a crash with that file holding another's bytes. Saves journal all of them.
+static uint64_t reusedWord(mfs_t *fs, int32_t word)
+{
+	return fs->freed_blocks[word] & ~fs->free_blocks[word] & ~fs->saved_free[word];
+}
+
+// Helper function that returns 1 if block is one of the reused blocks, which are counted on their own
+static int isReused(mfs_t *fs, int32_t block)
+{
+	return (reusedWord(fs, block / 64) >> (block % 64)) & 1;
+}
+
+// Helper function that moves the indirect or double-indirect block *pointer names to a block that is free both now
+// and in the last save, so it can be written in place, and points *pointer at the copy. *scan is the free map word
+// to resume looking from. Returns 0 on success and -1 if there is no such block
+static int moveMapBlock(mfs_t *fs, int32_t *pointer, int32_t *scan)
+{
+	for(; *scan < FREE_MAP_WORDS; (*scan)++)
+	{
+		uint64_t candidates = fs->free_blocks[*scan] & fs->saved_free[*scan];
+		if(candidates)
+		{
+			int32_t copy = *scan * 64 + __builtin_ctzll(candidates);
+			claimBlock(fs, copy);
+			memcpy(get_block(fs, copy), get_block(fs, *pointer), fs->sb->block_size);
+			mark_dirty(fs, get_block(fs, copy), fs->sb->block_size);
+			releaseBlock(fs, *pointer);
+			*pointer = copy;
+			mark_dirty(fs, pointer, sizeof(int32_t));
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Helper function that makes sure the journal has room for every reused block (see reusedWord) and every changed
+// extent block of a live file, neither of which a crash may leave half written. All of the metadata fits by design,
+// but only a share of the journal is set aside for data blocks. The reused blocks take it first, and extent blocks
+// past what is left are moved to blocks the last save did not use, which are written in place. The blocks they
+// leave are freed. Extent blocks are never shared with a snapshot, so moving one only means updating the single
+// pointer to it. Must run before the save works out which blocks it writes. Returns 0 on success and -1 with errno
+// set to ENOSPC if the reused blocks do not fit or there is nowhere to move the extent blocks
+static int reserveJournal(mfs_t *fs)
+{
+	int32_t room = journalCapacity(fs->sb) - fs->sb->journal_block;
+	int32_t scan = 0;
+	int32_t i;
+
+	for(i = 0; i < FREE_MAP_WORDS; i++)
+	{
+		room -= __builtin_popcountll(reusedWord(fs, i));
+	}
+	if(room < 0)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+
+	for(i = 0; i < fs->sb->num_files; i++)
+	{
+		struct inode *inode_ptr = &fs->inodes[i];
+		if(!inode_ptr->in_use)
+		{
+			continue;
+		}
+
+		// moving an indirect block changes the double-indirect block, so that one is looked at after them
+		if(inode_ptr->double_indirect != -1)
+		{
+			int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+			int32_t j;
+			for(j = 0; j < POINTERS_PER_BLOCK && pointers[j] != -1; j++)
+			{
+				if(needsJournal(fs, pointers[j]) && !isReused(fs, pointers[j]) && room-- <= 0 && moveMapBlock(fs, &pointers[j], &scan) < 0)
+				{
+					errno = ENOSPC;
+					return -1;
+				}
+			}
+		}
+		if((inode_ptr->double_indirect != -1 && needsJournal(fs, inode_ptr->double_indirect) && !isReused(fs, inode_ptr->double_indirect) && room-- <= 0 &&
+		    moveMapBlock(fs, &inode_ptr->double_indirect, &scan) < 0) ||
+		   (inode_ptr->indirect != -1 && needsJournal(fs, inode_ptr->indirect) && !isReused(fs, inode_ptr->indirect) && room-- <= 0 &&
+		    moveMapBlock(fs, &inode_ptr->indirect, &scan) < 0))
+		{
+			errno = ENOSPC;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Helper function that saves the dirty blocks through the journal. Blocks the last save's image does not use
+// are written in place first, since a crash cannot hurt anything by leaving them half written. The rest go to
+// the journal, which the header commits once they are on disk, and only then into place, so a crash
+// leaves either the last save or this one for replayJournal to finish. Metadata always fits in the journal,
+// and reserveJournal has made sure the extent blocks of live files and the reused blocks do too. Other file
+// data beyond its capacity is written in place with the first group, but the last save only gives such a block
+// to the file now writing it, so a crash can leave that file holding a mix of old and new data but never
+// breaks the structure of the image or touches another file.
+// Returns 0 on success and -1 on failure, with every block still dirty
+static int commitJournal(mfs_t *fs)
+{
+	int32_t   block_size        = fs->sb->block_size;
+	int32_t   capacity          = journalCapacity(fs->sb);
+	int32_t   descriptor_blocks = blocksFor((size_t)capacity * sizeof(int32_t), block_size);
+	uint64_t *journaled         = calloc(FREE_MAP_WORDS, sizeof(uint64_t));
+	int32_t  *targets           = malloc((size_t)descriptor_blocks * block_size);
+	int32_t   count  = 0;
+	int       status = -1;
+	int32_t   i;
+
+	if(!journaled || !targets)
+	{
+		free(journaled);
+		free(targets);
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(targets, 0xff, (size_t)descriptor_blocks * block_size);
+
+	// the metadata regions first, then the extent blocks of live files, then file data
+	for(i = 0; i < fs->sb->first_data_block; i++)
+	{
+		journalBlock(fs, journaled, targets, &count, capacity, i);
+	}
+	for(i = 0; i < fs->sb->num_files; i++)
+	{
+		struct inode *inode_ptr = &fs->inodes[i];
+		if(!inode_ptr->in_use)
+		{
+			continue;
+		}
+		if(inode_ptr->indirect != -1)
+		{
+			journalBlock(fs, journaled, targets, &count, capacity, inode_ptr->indirect);
+		}
+		if(inode_ptr->double_indirect != -1)
+		{
+			int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+			int32_t j;
+			journalBlock(fs, journaled, targets, &count, capacity, inode_ptr->double_indirect);
+			for(j = 0; j < POINTERS_PER_BLOCK && pointers[j] != -1; j++)
+			{
+				journalBlock(fs, journaled, targets, &count, capacity, pointers[j]);
+			}
+		}
+	}
+	for(i = 0; i < FREE_MAP_WORDS; i++)
+	{
+		uint64_t candidates = fs->dirty_blocks[i] & reusedWord(fs, i) & ~journaled[i];
+		while(candidates)
+		{
+			journalBlock(fs, journaled, targets, &count, capacity, i * 64 + __builtin_ctzll(candidates));
+			candidates &= candidates - 1;
+		}
+	}
+	for(i = 0; i < FREE_MAP_WORDS && count < capacity; i++)
+	{
+		uint64_t candidates = fs->dirty_blocks[i] & ~fs->saved_free[i] & ~journaled[i];
+		while(candidates)
+		{
+			journalBlock(fs, journaled, targets, &count, capacity, i * 64 + __builtin_ctzll(candidates));
+			candidates &= candidates - 1;
+		}
+	}
+	for(i = 0; i < FREE_MAP_WORDS; i++)
+	{
+		fs->dirty_blocks[i] &= ~journaled[i];
+	}
+
+	int   fd      = fs->image_fd;
+	off_t journal = (off_t)fs->sb->journal_block * block_size;
+	if(writeRuns(fs, fs->dirty_blocks) < 0)
+	{
+		goto done;
+	}
+	if(count > 0)
+	{
+		size_t   descriptor_bytes = (size_t)blocksFor((size_t)count * sizeof(int32_t), block_size) * block_size;
+		uint32_t sum = checksum(CHECKSUM_SEED, (uint8_t *)targets, descriptor_bytes);
+		for(i = 0; i < count; i++)
+		{
+			sum = checksum(sum, get_block(fs, targets[i]), block_size);
+		}
+
+		// one sequential write of the transaction, a sync, then the header that commits it
+		if(pwriteAll(fd, targets, descriptor_bytes, journal + block_size) < 0 ||
+		   writeJournalBlocks(fs, targets, count, journal + (off_t)(1 + descriptor_blocks) * block_size) < 0 ||
+		   fdatasync(fd) < 0 || writeJournalHeader(fd, fs->sb, count, sum) < 0 || fdatasync(fd) < 0)
+		{
+			goto done;
+		}
+		addCount(&fs->counters.saved_bytes, descriptor_bytes);
+
+		// the checkpoint. Replaying a transaction that is already in place does no harm, so retiring it
+		// does not need a sync of its own.
+		if(writeRuns(fs, journaled) < 0 || fdatasync(fd) < 0 || writeJournalHeader(fd, fs->sb, 0, 0) < 0)
+		{
+			goto done;
+		}
+	}
+	else if(fdatasync(fd) < 0)
+	{
+		goto done;
+	}
+	status = 0;
+
+done:
+	if(status < 0)
+	{
+		int error = errno;
+		for(i = 0; i < FREE_MAP_WORDS; i++)
+		{
+			fs->dirty_blocks[i] |= journaled[i];
+		}
+		errno = error;
+	}
+	free(journaled);
+	free(targets);
+	return status;
+}
+
+// Helper function that makes every delete so far permanent by dropping the inode number from deleted
+// directory entries, after which undel reports them as stale. Their names stay until the slot is reused.
+static void forgetDeleted(mfs_t *fs)
+{
+	int32_t i;
+	for(i = 0; i < fs->sb->num_files; i++)
+	{
+		struct directoryEntry *entry = &fs->directory[i];
+		if(!entry->in_use && entry->inode != -1)
+		{
+			entry->inode = -1;
+			mark_dirty(fs, entry, sizeof(struct directoryEntry));
+		}
+	}
+}
+
+// Helper function that punches the blocks in freed_blocks out of the image file and clears the map.
+// Only called once a save is on disk, when nothing the file holds refers to those blocks any more.
+// A host file system that cannot punch holes simply keeps the space.
+static void punchFreedBlocks(mfs_t *fs)
+{
+	struct ioRing *ring  = handleRing(fs);
+	int32_t        block = 0;
+
+	while(block < fs->sb->num_blocks)
+	{
+		if(fs->freed_blocks[block / 64] == 0)
+		{
+			block = (block / 64 + 1) * 64;
+			continue;
+		}
+		if(!testBlock(fs->freed_blocks, block))
+		{
+			block++;
+			continue;
+		}
+
+		int32_t start = block;
+		while(block < fs->sb->num_blocks && testBlock(fs->freed_blocks, block))
+		{
+			block++;
+		}
+		off_t  pos = (off_t)start * fs->sb->block_size;
+		size_t len = (size_t)(block - start) * fs->sb->block_size;
+		if(ring)
+		{
+			ringQueue(ring, RING_PUNCH, fs->image_fd, NULL, len, pos, NULL, 0);
+		}
+		else
+		{
+			punchHole(fs->image_fd, pos, len);
+		}
+	}
+	if(ring)
+	{
+		ringFinish(ring);
+	}
+	memset(fs->freed_blocks, 0, FREE_MAP_WORDS * sizeof(uint64_t));
+}
+
+// Helper function that writes every dirty block back to the image and waits for it to reach the disk.
+// A fresh image has nothing on disk worth protecting and an image without a journal has no choice, so
+// both are written in place. Returns 0 on success and -1 on failure
+static int saveImage(mfs_t *fs)
+{
+	int32_t i;
+
+	if(!fs->fresh && fs->sb->journal_blocks != 0 && reserveJournal(fs) < 0)
+	{
+		return -1;
+	}
+
+	// blocks freed since the last save are given back to the host rather than written, so the files
+	// deleted so far can no longer be brought back. Those taken again stay in freed_blocks until the
+	// save is on disk, so commitJournal can tell them apart.
+	forgetDeleted(fs);
+	for(i = 0; i < FREE_MAP_WORDS; i++)
+	{
+		fs->dirty_blocks[i] &= ~(fs->freed_blocks[i] & fs->free_blocks[i]);
+	}
+	updateChecksums(fs);
+
+	if(fs->fresh || fs->sb->journal_blocks == 0)
+	{
+		if(writeRuns(fs, fs->dirty_blocks) < 0 || fdatasync(fs->image_fd) < 0)
+		{
+			return -1;
+		}
+	}
+	else if(commitJournal(fs) < 0)
+	{
+		return -1;
+	}
+
+	for(i = 0; i < FREE_MAP_WORDS; i++)
+	{
+		fs->freed_blocks[i] &= fs->free_blocks[i];
+	}
+	punchFreedBlocks(fs);
+	for(i = 0; fs->cache_limit && i < FREE_MAP_WORDS; i++)
+	{
+		uint64_t saved = fs->dirty_blocks[i];
+		while(saved)
+		{
+			noteCached(fs, i * 64 + __builtin_ctzll(saved), 1, 0);
+			saved &= saved - 1;
+		}
+	}
+	memset(fs->dirty_blocks, 0, FREE_MAP_WORDS * sizeof(uint64_t));
+	memcpy(fs->saved_free, fs->free_blocks, FREE_MAP_WORDS * sizeof(uint64_t));
+	fs->fresh = 0;
+	return 0;
+}
+
+// Helper function that finishes a save a crash interrupted after its journal was committed by copying the
+// journaled blocks into place again. It runs on the file before it is mapped; an image whose superblock
+// does not describe a journal is left for validSuperblock to judge. Returns 0 on success and a negative
+// errno on failure
+static int replayJournal(int fd)
+{
+	struct superblock    super;
+	struct journalHeader header;
+	struct stat          buf;
+
+	if(fstat(fd, &buf) < 0)
+	{
+		return -errno;
+	}
+	if(pread(fd, &super, sizeof(super), 0) != sizeof(super) || super.magic != MFS_MAGIC ||
+	   !validBlockSize(super.block_size) || super.num_blocks <= 0 || super.journal_block < 1 ||
+	   super.journal_blocks < 2 || super.journal_block > super.num_blocks - super.journal_blocks ||
+	   (off_t)super.num_blocks * super.block_size > buf.st_size)
+	{
+		return 0;
+	}
+
+	size_t  block_size = super.block_size;
+	off_t   journal    = (off_t)super.journal_block * block_size;
+	int32_t capacity   = journalCapacity(&super);
+	if(pread(fd, &header, sizeof(header), journal) != sizeof(header) || header.magic != JOURNAL_MAGIC ||
+	   header.count <= 0 || header.count > capacity)
+	{
+		return 0;
+	}
+
+	size_t   descriptor_bytes = (size_t)blocksFor((size_t)header.count * sizeof(int32_t), block_size) * block_size;
+	off_t    first            = journal + (off_t)(1 + blocksFor((size_t)capacity * sizeof(int32_t), block_size)) * block_size;
+	int32_t *targets          = malloc(descriptor_bytes);
+	uint8_t *block            = malloc(block_size);
+	int      status           = 0;
+	int32_t  i;
+
+	if(!targets || !block)
+	{
+		free(targets);
+		free(block);
+		return -ENOMEM;
+	}
+
+	// a transaction whose checksum does not match was never committed, and the image still holds the last save
+	if(pread(fd, targets, descriptor_bytes, journal + block_size) != (ssize_t)descriptor_bytes)
+	{
+		status = -EIO;
+		goto done;
+	}
+	uint32_t sum = checksum(CHECKSUM_SEED, (uint8_t *)targets, descriptor_bytes);
+	for(i = 0; i < header.count; i++)
+	{
+		if(pread(fd, block, block_size, first + (off_t)i * block_size) != (ssize_t)block_size)
+		{
+			status = -EIO;
+			goto done;
+		}
+		sum = checksum(sum, block, block_size);
+	}
+	if(sum != header.checksum)
+	{
+		goto done;
+	}
+
+	for(i = 0; i < header.count; i++)
+	{
+		int32_t target = targets[i];
+		if(target < 0 || target >= super.num_blocks ||
+		   (target >= super.journal_block && target < super.journal_block + super.journal_blocks))
+		{
+			status = -EINVAL;
+			goto done;
+		}
+		if(pread(fd, block, block_size, first + (off_t)i * block_size) != (ssize_t)block_size)
+		{
+			status = -EIO;
+			goto done;
+		}
+		if(pwriteAll(fd, block, block_size, (off_t)target * block_size) < 0)
+		{
+			status = -errno;
+			goto done;
+		}
+	}
+	if(fdatasync(fd) < 0 || writeJournalHeader(fd, &super, 0, 0) < 0 || fdatasync(fd) < 0)
+	{
+		status = -errno;
+	}
+
+done:
+	free(targets);
+	free(block);
+	return status;
+}
+
+// Helper function that passes the outcome for one file to the caller's report callback, if any
+static void reportFile(mfs_report_fn report, void *arg, const char *name, int status)
+{
+    if (report)
+    {
+        report(arg, name, status);
+    }
+}
+
+// Helper function that rotates x left by r bits
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// Helper function that mixes 8 bytes of input into one XXH64 accumulator
+static uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+// Helper function that returns 8 bytes at p as a little-endian number
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Helper function that returns the XXH64 hash (seed 0) of len bytes. The four accumulators are independent,
+// so the main loop keeps several multiplies in flight at once.
+static uint64_t hashBytes(const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        uint64_t v1 = XXH_PRIME1 + XXH_PRIME2;
+        uint64_t v2 = XXH_PRIME2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -XXH_PRIME1;
+        do
+        {
+            v1 = xxhRound(v1, read64(p));
+            v2 = xxhRound(v2, read64(p + 8));
+            v3 = xxhRound(v3, read64(p + 16));
+            v4 = xxhRound(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = (h ^ xxhRound(0, v1)) * XXH_PRIME1 + XXH_PRIME4;
+        h = (h ^ xxhRound(0, v2)) * XXH_PRIME1 + XXH_PRIME4;
+        h = (h ^ xxhRound(0, v3)) * XXH_PRIME1 + XXH_PRIME4;
+        h = (h ^ xxhRound(0, v4)) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    else
+    {
+        h = XXH_PRIME5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8)
+    {
+        h = rotl64(h ^ xxhRound(0, read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end)
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        h = rotl64(h ^ (value * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h = rotl64(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Helper function that puts an entry in the first empty slot for its hash. size is a power of two.
+static void placeHash(struct blockHash *table, uint32_t size, uint64_t hash, int32_t block)
+{
+    uint32_t slot = hash & (size - 1);
+    while (table[slot].block != -1)
+    {
+        slot = (slot + 1) & (size - 1);
+    }
+    table[slot].hash  = hash;
+    table[slot].block = block;
+}
+
+// Helper function that adds a block whose contents hash to hash to the dedup index, doubling the table
+// once it is half full. Entries for blocks freed since they were added are dropped along the way.
+// Returns 0 on success and -1 if the table could not grow.
+static int indexBlock(mfs_t *fs, uint64_t hash, int32_t block)
+{
+    if (2 * (fs->block_index_count + 1) > fs->block_index_size)
+    {
+        uint32_t size = fs->block_index_size ? fs->block_index_size * 2 : MIN_BLOCK_INDEX;
+        struct blockHash *table = malloc(size * sizeof(struct blockHash));
+        uint32_t i;
+        if (!table)
+        {
+            return -1;
+        }
+        for (i = 0; i < size; i++)
+        {
+            table[i].block = -1;
+        }
+
+        fs->block_index_count = 0;
+        for (i = 0; i < fs->block_index_size; i++)
+        {
+            int32_t old = fs->block_index[i].block;
+            if (old != -1 && testBlock(fs->hashed_blocks, old))
+            {
+                placeHash(table, size, fs->block_index[i].hash, old);
+                fs->block_index_count++;
+            }
+        }
+        free(fs->block_index);
+        fs->block_index      = table;
+        fs->block_index_size = size;
+    }
+
+    placeHash(fs->block_index, fs->block_index_size, hash, block);
+    fs->block_index_count++;
+    fs->hashed_blocks[block / 64] |= 1ULL << (block % 64);
+    return 0;
+}
+
+// Helper function that returns a block in the dedup index holding the same bytes as data, which hash to
+// hash, or -1 if there is none
+static int32_t findDuplicate(mfs_t *fs, uint64_t hash, const uint8_t *data)
+{
+    if (!fs->block_index)
+    {
+        return -1;
+    }
+
+    uint32_t mask = fs->block_index_size - 1;
+    uint32_t slot = hash & mask;
+    while (fs->block_index[slot].block != -1)
+    {
+        int32_t block = fs->block_index[slot].block;
+        if (fs->block_index[slot].hash == hash && testBlock(fs->hashed_blocks, block) &&
+            memcmp(get_block(fs, block), data, fs->sb->block_size) == 0)
+        {
+            return block;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+// Helper function that builds the dedup index from the data blocks of every file in the image.
+// Returns 0 on success and -1 if there is not enough memory.
+static int buildBlockIndex(mfs_t *fs)
+{
+    fs->hashed_blocks = calloc(FREE_MAP_WORDS, sizeof(uint64_t));
+    if (!fs->hashed_blocks)
+    {
+        return -1;
+    }
+
+    int32_t i;
+    for (i = 0; i < fs->sb->num_files; i++)
+    {
+        struct extent *ext;
+        int32_t n;
+        for (n = 0; fs->inodes[i].in_use && (ext = getExtent(fs, &fs->inodes[i], n, 0)) && ext->length; n++)
+        {
+            int32_t j;
+            for (j = 0; j < ext->length; j++)
+            {
+                int32_t block = ext->start + j;
+                if (!testBlock(fs->hashed_blocks, block) &&
+                    indexBlock(fs, hashBytes(get_block(fs, block), fs->sb->block_size), block) < 0)
+                {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Helper function that returns 4 bytes at p as a little-endian number
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Helper function that appends a length that did not fit in its token nibble, as LZ4 does: 255 for every
+// full 255 and then the remainder
+static size_t putLength(uint8_t *out, size_t length)
+{
+    size_t n = 0;
+    for (; length >= 255; length -= 255)
+    {
+        out[n++] = 255;
+    }
+    out[n++] = length;
+    return n;
+}
+
+// Helper function that appends one LZ4 sequence: literals bytes of literal data from src followed by a
+// match of match_length bytes offset bytes back, or no match when match_length is 0. Returns the new
+// output position, or 0 if the sequence would not fit in capacity.
+static size_t putSequence(uint8_t *out, size_t pos, size_t capacity, const uint8_t *src, size_t literals,
+                          size_t offset, size_t match_length)
+{
+    // token, both lengths at their longest, the literals and the offset
+    if (pos > capacity || capacity - pos < 1 + (literals / 255 + 1) + literals + 2 + (match_length / 255 + 1))
+    {
+        return 0;
+    }
+
+    size_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+    uint8_t *token = &out[pos++];
+    *token = (literals < 15 ? literals : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (literals >= 15)
+    {
+        pos += putLength(out + pos, literals - 15);
+    }
+    memcpy(out + pos, src, literals);
+    pos += literals;
+
+    if (match_length)
+    {
+        out[pos++] = offset & 0xff;
+        out[pos++] = offset >> 8;
+        if (match_code >= 15)
+        {
+            pos += putLength(out + pos, match_code - 15);
+        }
+    }
+    return pos;
+}
+
+// Helper function that compresses len bytes into at most capacity bytes in the LZ4 block format, finding
+// matches through a hash of the next 4 bytes and skipping ahead faster the longer nothing matches.
+// Returns the compressed size, or 0 if it does not fit.
+static size_t compressChunk(const uint8_t *src, size_t len, uint8_t *out, size_t capacity)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    size_t   ip = 0;
+    size_t   anchor = 0;
+    size_t   pos = 0;
+
+    memset(table, 0, sizeof(table));
+
+    // LZ4 ends every block with at least 5 literals and starts no match in the last 12 bytes
+    while (ip + 12 <= len)
+    {
+        uint32_t sequence = read32(src + ip);
+        uint32_t slot = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t   candidate = table[slot];
+        table[slot] = ip;
+
+        if (candidate >= ip || ip - candidate > LZ_MAX_OFFSET || read32(src + candidate) != sequence)
+        {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t end = ip + LZ_MIN_MATCH;
+        while (end < len - 5 && src[end] == src[candidate + end - ip])
+        {
+            end++;
+        }
+        if (!(pos = putSequence(out, pos, capacity, src + anchor, ip - anchor, ip - candidate, end - ip)))
+        {
+            return 0;
+        }
+        ip = anchor = end;
+    }
+    return len > anchor ? putSequence(out, pos, capacity, src + anchor, len - anchor, 0, 0) : pos;
+}
+
+// Helper function that reads a length continued past its token nibble. Returns 0 on success and -1 if the
+// input runs out first.
+static int getLength(const uint8_t *in, size_t len, size_t *pos, size_t *length)
+{
+    uint8_t byte;
+    do
+    {
+        if (*pos >= len)
+        {
+            return -1;
+        }
+        byte = in[(*pos)++];
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Helper function that decompresses an LZ4 block of len bytes that must come out as exactly size bytes.
+// Every length and offset is checked, so a damaged block cannot reach outside either buffer.
+// Returns 0 on success and -EIO if the block is damaged.
+static int decompressChunk(const uint8_t *in, size_t len, uint8_t *out, size_t size)
+{
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < len)
+    {
+        uint8_t token = in[ip++];
+        size_t  literals = token >> 4;
+        if (literals == 15 && getLength(in, len, &ip, &literals) < 0)
+        {
+            return -EIO;
+        }
+        if (literals > len - ip || literals > size - op)
+        {
+            return -EIO;
+        }
+        memcpy(out + op, in + ip, literals);
+        ip += literals;
+        op += literals;
+
+        // the last sequence has no match
+        if (ip == len)
+        {
+            break;
+        }
+
+        if (len - ip < 2)
+        {
+            return -EIO;
+        }
+        size_t offset = in[ip] | in[ip + 1] << 8;
+        size_t match_length = token & 15;
+        ip += 2;
+        if (match_length == 15 && getLength(in, len, &ip, &match_length) < 0)
+        {
+            return -EIO;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_length > size - op)
+        {
+            return -EIO;
+        }
+
+        // the match may overlap the bytes it produces, so it goes a byte at a time
+        const uint8_t *from = out + op - offset;
+        size_t i;
+        for (i = 0; i < match_length; i++)
+        {
+            out[op + i] = from[i];
+        }
+        op += match_length;
+    }
+    return op == size ? 0 : -EIO;
+}
+
+// Helper function that packs size bytes of file data into the compressed layout: a chunk index of
+// offsets followed by each COMPRESS_CHUNK bytes compressed on its own, or stored as they are when that
+// is no smaller. Returns the packed bytes, which the caller frees, and stores their length in packed_size.
+// Returns NULL if packing would not save at least one block of block_size bytes, or there is no memory.
+static uint8_t *packFile(const uint8_t *raw, uint32_t size, int32_t block_size, size_t *packed_size)
+{
+    uint32_t chunks = (size + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    size_t   index_bytes = (chunks + 1) * sizeof(uint32_t);
+    size_t   limit = (size_t)(blocksFor(size, block_size) - 1) * block_size;
+
+    if (size == 0 || index_bytes >= limit)
+    {
+        return NULL;
+    }
+    uint8_t *packed = malloc(limit);
+    if (!packed)
+    {
+        return NULL;
+    }
+
+    uint32_t *index = (uint32_t *)packed;
+    size_t    pos = index_bytes;
+    uint32_t  c;
+    for (c = 0; c < chunks; c++)
+    {
+        const uint8_t *chunk = raw + (size_t)c * COMPRESS_CHUNK;
+        size_t len = size - (size_t)c * COMPRESS_CHUNK < COMPRESS_CHUNK ? size - (size_t)c * COMPRESS_CHUNK : COMPRESS_CHUNK;
+        size_t room = limit - pos < len - 1 ? limit - pos : len - 1;
+        size_t n = compressChunk(chunk, len, packed + pos, room);
+
+        if (n == 0)
+        {
+            if (len > limit - pos)
+            {
+                free(packed);
+                return NULL;
+            }
+            memcpy(packed + pos, chunk, len);
+            n = len;
+        }
+        index[c] = pos;
+        pos += n;
+    }
+    index[chunks] = pos;
+
+    *packed_size = pos;
+    return packed;
+}
+
+// a source file queued by insert, with the directory slot, inode and blocks planned for it
+struct pendingInsert
+{
+    char     filename[64];
+    uint32_t file_size;
+    int32_t  required_blocks;
+    int32_t  directory_index;
+    int32_t  inode;
+    int      status;
+    int      compressed;    // set once the file has been packed into its first required_blocks blocks
+    uint64_t *hashes;       // the hash of each block once it is copied in, when deduplicating
+};
+
+// the files of one insert. Reader threads take the next file to copy from next.
+struct insertBatch
+{
+    mfs_t *fs;
+    struct pendingInsert *files;
+    int count;
+    int capacity;
+    int next;
+    int dedup;
+    int compress;
+    mfs_report_fn report;
+    void *arg;
+};
+
+static int queueInsert(mfs_t *fs, struct insertBatch *batch, const char *src_filename, int recursive);
+
+// Helper function that queues every file under a host directory, descending into subdirectories.
+// Returns 0 or the first failure, which has already been reported.
+static int queueDirectory(mfs_t *fs, struct insertBatch *batch, const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        int status = -errno;
+        reportFile(batch->report, batch->arg, path, status);
+        return status;
+    }
+
+    int result = 0;
+    size_t path_length = strlen(path);
+    const char *separator = path_length && path[path_length - 1] == '/' ? "" : "/";
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        //a path that doesn't fit here is far too long to be a filename anyway
+        char child[4096];
+        int  status;
+        if (snprintf(child, sizeof(child), "%s%s%s", path, separator, entry->d_name) >= (int)sizeof(child))
+        {
+            status = -ENAMETOOLONG;
+            reportFile(batch->report, batch->arg, entry->d_name, status);
+        }
+        else
+        {
+            status = queueInsert(fs, batch, child, 1);
+        }
+
+        if (status < 0 && result == 0)
+        {
+            result = status;
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+// Helper function that checks a host file can be inserted and adds it to the batch. Directories
+// are walked when recursive is set. Nothing in the image is touched. Returns 0 or the first
+// failure, which has already been reported.
+static int queueInsert(mfs_t *fs, struct insertBatch *batch, const char *src_filename, int recursive)
+{
+    struct stat buf;
+    int status = 0;
+    int i;
+
+    if (stat(src_filename, &buf) < 0)
+    {
+        status = -errno;
+    }
+    else if (S_ISDIR(buf.st_mode))
+    {
+        if (recursive)
+        {
+            return queueDirectory(fs, batch, src_filename);
+        }
+        status = -EISDIR;
+    }
+    else if (!S_ISREG(buf.st_mode))
+    {
+        status = -EINVAL;
+    }
+    else if (strlen(src_filename) > MFS_NAME_MAX)
+    {
+        status = -ENAMETOOLONG;
+    }
+    else if (buf.st_size > MAX_FILE_SIZE)
+    {
+        status = -EFBIG;
+    }
+    else if (findFile(fs, src_filename, 1) != -1)
+    {
+        status = -EEXIST;
+    }
+
+    for (i = 0; i < batch->count && status == 0; i++)
+    {
+        if (strcmp(batch->files[i].filename, src_filename) == 0)
+        {
+            status = -EEXIST;
+        }
+    }
+
+    if (status == 0 && batch->count == batch->capacity)
+    {
+        int capacity = batch->capacity ? batch->capacity * 2 : 16;
+        struct pendingInsert *files = realloc(batch->files, capacity * sizeof(struct pendingInsert));
+        if (!files)
+        {
+            status = -ENOMEM;
+        }
+        else
+        {
+            batch->files = files;
+            batch->capacity = capacity;
+        }
+    }
+
+    if (status < 0)
+    {
+        reportFile(batch->report, batch->arg, src_filename, status);
+        return status;
+    }
+
+    struct pendingInsert *pending = &batch->files[batch->count++];
+    memset(pending, 0, sizeof(struct pendingInsert));
+    strncpy(pending->filename, src_filename, MFS_NAME_MAX);
+    pending->file_size = buf.st_size;
+    pending->required_blocks = blocksFor(buf.st_size, fs->sb->block_size);
+    return 0;
+}
+
+// Helper function that picks a directory slot and inode for every queued file and allocates all
+// of their blocks. The whole batch is placed in a single best-fitting run when one is big enough,
+// so one free-space scan serves every file; otherwise each file gets its own extents. Returns 0 on
+// success, or -ENFILE or -ENOSPC if the batch does not fit, in which case nothing is allocated.
+static int planInserts(mfs_t *fs, struct insertBatch *batch)
+{
+    int64_t total_blocks = 0;
+    int32_t directory_index = 0;
+    int32_t inode_ix = 0;
+    int i;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        struct pendingInsert *pending = &batch->files[i];
+
+        while (directory_index < fs->sb->num_files && fs->directory[directory_index].in_use)
+        {
+            directory_index++;
+        }
+        while (inode_ix < fs->sb->num_files && fs->inodes[inode_ix].in_use)
+        {
+            inode_ix++;
+        }
+
+        if (directory_index == fs->sb->num_files || inode_ix == fs->sb->num_files)
+        {
+            return -ENFILE;
+        }
+
+        pending->directory_index = directory_index++;
+        pending->inode = inode_ix++;
+        total_blocks += pending->required_blocks;
+    }
+
+    if (total_blocks > fs->free_block_count)
+    {
+        return -ENOSPC;
+    }
+
+    //clear out whatever extent lists previous owners of these inodes left behind
+    for (i = 0; i < batch->count; i++)
+    {
+        resetExtents(fs, &fs->inodes[batch->files[i].inode]);
+    }
+
+    int32_t length = 0;
+    int32_t start = total_blocks ? findFreeRun(fs, total_blocks, &length) : -1;
+    if (start != -1 && length >= total_blocks)
+    {
+        //carve the run up in queue order, one direct extent per file
+        for (i = 0; i < batch->count; i++)
+        {
+            struct pendingInsert *pending = &batch->files[i];
+            struct extent *ext = &fs->inodes[pending->inode].extents[0];
+            int32_t j;
+
+            if (pending->required_blocks == 0)
+            {
+                continue;
+            }
+            for (j = 0; j < pending->required_blocks; j++)
+            {
+                claimBlock(fs, start + j);
+            }
+            ext->start  = start;
+            ext->length = pending->required_blocks;
+            mark_dirty(fs, ext, sizeof(struct extent));
+            start += pending->required_blocks;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < batch->count; i++)
+    {
+        //the indirect blocks of heavily fragmented files can still run us out of space
+        if (allocateExtents(fs, batch->files[i].inode, batch->files[i].required_blocks) < 0)
+        {
+            while (--i >= 0)
+            {
+                truncateExtents(fs, &fs->inodes[batch->files[i].inode], 0);
+            }
+            return -ENOSPC;
+        }
+    }
+    return 0;
+}
+
+// Helper function that copies a queued file into the blocks planned for it. Each extent is
+// contiguous in data, so it is filled with a single read, or with a ring, with reads of up to
+// RING_CHUNK bytes that are all in flight together. Only the file's own blocks are written,
+// so several of these can run at once.
+static void readSource(mfs_t *fs, struct pendingInsert *pending, struct ioRing *ring)
+{
+    int src_fd = open(pending->filename, O_RDONLY);
+    if (src_fd < 0)
+    {
+        pending->status = -errno;
+        return;
+    }
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint32_t bytes_left = pending->file_size;
+    struct extent *ext;
+    int32_t i;
+    for (i = 0; (ext = getExtent(fs, &fs->inodes[pending->inode], i, 0)) && ext->length; i++)
+    {
+        size_t   extent_bytes = (size_t)ext->length * fs->sb->block_size;
+        size_t   to_read = bytes_left < extent_bytes ? bytes_left : extent_bytes;
+        uint8_t *dest = get_block(fs, ext->start);
+        size_t   done = 0;
+
+        if (ring)
+        {
+            // a short read zeroes the rest of its piece, like the tail below
+            off_t src_pos = pending->file_size - bytes_left;
+            for (done = 0; done < to_read; done += RING_CHUNK)
+            {
+                size_t piece = to_read - done < RING_CHUNK ? to_read - done : RING_CHUNK;
+                ringQueue(ring, RING_READ, src_fd, dest + done, piece, src_pos + done, NULL, 0);
+            }
+            done = to_read;
+        }
+        while (done < to_read)
+        {
+            ssize_t got = read(src_fd, dest + done, to_read - done);
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got < 0)
+            {
+                pending->status = -errno;
+            }
+            if (got <= 0)
+            {
+                break;
+            }
+            done += got;
+        }
+
+        //don't let the tail of the last block keep a deleted file's bytes
+        memset(dest + done, 0, extent_bytes - done);
+        bytes_left -= to_read;
+        addCount(&fs->counters.host_bytes_read, done);
+        addCount(&fs->counters.image_bytes_written, done);
+    }
+
+    if (ring && ringFinish(ring) < 0)
+    {
+        pending->status = -errno;
+    }
+    close(src_fd);
+}
+
+// Helper function that packs a file that has just been copied in into the compressed layout, writing it
+// over the start of the file's own blocks and lowering required_blocks to what it now fills. commitInsert
+// gives the rest back. Files that would not shrink by a block are left as they are.
+static void compressFile(mfs_t *fs, struct pendingInsert *pending)
+{
+    struct inode  *inode_ptr = &fs->inodes[pending->inode];
+    struct extent *ext = &inode_ptr->extents[0];
+    uint8_t *raw = get_block(fs, ext->start);
+    uint8_t *copy = NULL;
+    int32_t  i;
+
+    if (pending->status < 0 || pending->required_blocks < 2)
+    {
+        return;
+    }
+
+    // a file placed in one run can be packed straight out of its blocks
+    if (ext->length < pending->required_blocks)
+    {
+        if (!(raw = copy = malloc(pending->file_size)))
+        {
+            return;
+        }
+        size_t done = 0;
+        for (i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length && done < pending->file_size; i++)
+        {
+            size_t n = (size_t)ext->length * fs->sb->block_size;
+            if (n > pending->file_size - done)
+            {
+                n = pending->file_size - done;
+            }
+            memcpy(copy + done, get_block(fs, ext->start), n);
+            done += n;
+        }
+    }
+
+    size_t   packed_size;
+    uint8_t *packed = packFile(raw, pending->file_size, fs->sb->block_size, &packed_size);
+    free(copy);
+    if (!packed)
+    {
+        return;
+    }
+
+    size_t done = 0;
+    for (i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length && done < packed_size; i++)
+    {
+        uint8_t *dest = get_block(fs, ext->start);
+        size_t   n = (size_t)ext->length * fs->sb->block_size;
+        if (n > packed_size - done)
+        {
+            //don't let the tail of the last block keep any of the uncompressed bytes
+            n = packed_size - done;
+            memset(dest + n, 0, (size_t)blocksFor(n, fs->sb->block_size) * fs->sb->block_size - n);
+        }
+        memcpy(dest, packed + done, n);
+        done += n;
+    }
+    free(packed);
+
+    pending->required_blocks = blocksFor(packed_size, fs->sb->block_size);
+    pending->compressed = 1;
+}
+
+// Helper function that hashes each block of a file that has just been copied in, for dedupFile.
+// The hashes are left out if there is no memory for them, and the file is simply not deduplicated.
+static void hashFile(mfs_t *fs, struct pendingInsert *pending)
+{
+    if (pending->status < 0 || pending->required_blocks == 0 ||
+        !(pending->hashes = malloc(pending->required_blocks * sizeof(uint64_t))))
+    {
+        return;
+    }
+
+    struct extent *ext;
+    int32_t i;
+    int32_t k = 0;
+    for (i = 0; (ext = getExtent(fs, &fs->inodes[pending->inode], i, 0)) && ext->length; i++)
+    {
+        int32_t j;
+        for (j = 0; j < ext->length && k < pending->required_blocks; j++)
+        {
+            pending->hashes[k++] = hashBytes(get_block(fs, ext->start + j), fs->sb->block_size);
+        }
+    }
+}
+
+// Reader thread body: copies queued files until the batch runs out
+static void *insertReader(void *arg)
+{
+    struct insertBatch *batch = arg;
+    struct ioRing *ring = ringSetup();
+    int i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+    {
+        readSource(batch->fs, &batch->files[i], ring);
+        if (batch->compress)
+        {
+            compressFile(batch->fs, &batch->files[i]);
+        }
+        if (batch->dedup)
+        {
+            hashFile(batch->fs, &batch->files[i]);
+        }
+    }
+    ringTeardown(ring);
+    return NULL;
+}
+
+// Helper function that puts a file called name with inode and file_size bytes in directory slot
+// entry_ix. The inode's extent list must already be in place.
+static void fillEntry(mfs_t *fs, int32_t entry_ix, int32_t inode, const char *name, uint32_t file_size)
+{
+    struct directoryEntry *entry = &fs->directory[entry_ix];
+
+    //the slot may still hold a deleted file that undel could have found by name
+    if (entry->filename[0])
+    {
+        unindexName(fs, entry_ix);
+    }
+    memset(entry->filename, 0, 64);
+    strncpy(entry->filename, name, MFS_NAME_MAX);
+    indexName(fs, entry_ix);
+    entry->inode = inode;
+    entry->in_use = 1;
+    entry->readOnly = 0;
+    entry->hidden = 0;
+    mark_dirty(fs, entry, sizeof(struct directoryEntry));
+
+    fs->inodes[inode].in_use = 1;
+    fs->inodes[inode].file_size = file_size;
+    fs->inodes[inode].attribute = 0;
+    mark_dirty(fs, &fs->inodes[inode], sizeof(struct inode));
+}
+
+// Helper function that marks every data block of a file dirty
+static void markFileDirty(mfs_t *fs, struct inode *inode_ptr)
+{
+    struct extent *ext;
+    int32_t i;
+    for (i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+    {
+        mark_dirty(fs, get_block(fs, ext->start), (size_t)ext->length * fs->sb->block_size);
+    }
+}
+
+// Helper function that points each block of a freshly copied file that holds the same bytes as a block
+// already in the image at that block instead and gives its own copy back. The extent list is rebuilt
+// from the result, and the blocks the file keeps go into the index for the files after it. Only those
+// are marked dirty, so a duplicate block costs nothing to save.
+static void dedupFile(mfs_t *fs, struct pendingInsert *pending)
+{
+    struct inode *inode_ptr = &fs->inodes[pending->inode];
+    int32_t  blocks = pending->required_blocks;
+    int32_t *own    = malloc(blocks * sizeof(int32_t));
+    int32_t *target = malloc(blocks * sizeof(int32_t));
+    int32_t  shared = 0;
+    int32_t  runs   = 0;
+    int32_t  i, k;
+    struct extent *ext;
+
+    if (!own || !target)
+    {
+        free(own);
+        free(target);
+        markFileDirty(fs, inode_ptr);
+        return;
+    }
+
+    k = 0;
+    for (i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+    {
+        int32_t j;
+        for (j = 0; j < ext->length; j++)
+        {
+            own[k++] = ext->start + j;
+        }
+    }
+
+    // a block shared with the index gains its reference right away, so the cap holds within the file
+    for (k = 0; k < blocks; k++)
+    {
+        int32_t dup = findDuplicate(fs, pending->hashes[k], get_block(fs, own[k]));
+        if (dup != -1 && fs->refcounts[dup] < MAX_DEDUP_REFS)
+        {
+            target[k] = dup;
+            fs->refcounts[dup]++;
+            mark_dirty(fs, &fs->refcounts[dup], sizeof(uint16_t));
+            shared++;
+        }
+        else
+        {
+            target[k] = own[k];
+            indexBlock(fs, pending->hashes[k], own[k]);
+        }
+        if (k == 0 || target[k] != target[k - 1] + 1)
+        {
+            runs++;
+        }
+    }
+
+    // a file that ends up in many small pieces may need more indirect blocks than it gives back
+    if (shared > 0 && mapBlocksFor(fs, runs) > fs->free_block_count + shared + countMapBlocks(fs, inode_ptr))
+    {
+        for (k = 0; k < blocks; k++)
+        {
+            if (target[k] != own[k])
+            {
+                fs->refcounts[target[k]]--;
+            }
+        }
+        shared = 0;
+    }
+    if (shared == 0)
+    {
+        free(own);
+        free(target);
+        markFileDirty(fs, inode_ptr);
+        return;
+    }
+
+    for (k = 0; k < blocks; k++)
+    {
+        if (target[k] != own[k])
+        {
+            releaseBlock(fs, own[k]);
+        }
+    }
+    releaseMapBlocks(fs, inode_ptr);
+
+    for (i = 0, k = 0; k < blocks && (ext = getExtent(fs, inode_ptr, i, 1)); i++)
+    {
+        int32_t length = 1;
+        while (k + length < blocks && target[k + length] == target[k] + length)
+        {
+            length++;
+        }
+        ext->start  = target[k];
+        ext->length = length;
+        mark_dirty(fs, ext, sizeof(struct extent));
+        k += length;
+    }
+
+    for (k = 0; k < blocks; k++)
+    {
+        if (target[k] == own[k])
+        {
+            mark_dirty(fs, get_block(fs, own[k]), fs->sb->block_size);
+        }
+    }
+    free(own);
+    free(target);
+}
+
+// Helper function that fills in the directory entry and inode of a copied file, or hands its
+// blocks back if the copy failed. Runs on the calling thread once every reader is done.
+static void commitInsert(mfs_t *fs, struct pendingInsert *pending)
+{
+    struct inode *inode_ptr = &fs->inodes[pending->inode];
+
+    if (pending->status < 0)
+    {
+        truncateExtents(fs, inode_ptr, 0);
+        return;
+    }
+
+    if (pending->compressed)
+    {
+        shrinkFile(fs, inode_ptr, pending->required_blocks);
+    }
+    if (pending->hashes)
+    {
+        dedupFile(fs, pending);
+    }
+    else
+    {
+        markFileDirty(fs, inode_ptr);
+    }
+
+    fillEntry(fs, pending->directory_index, pending->inode, pending->filename, pending->file_size);
+    if (pending->compressed)
+    {
+        inode_ptr->attribute = MFS_ATTR_COMPRESSED;
+    }
+}
+
+// Helper function that returns a pointer to byte offset of a file's blocks and stores in contiguous
+// how many bytes follow it in the same extent. Returns NULL past the last allocated block.
+static uint8_t *fileBytes(mfs_t *fs, struct inode *inode_ptr, uint64_t offset, size_t *contiguous)
+{
+    struct extent *ext;
+    int32_t i;
+    for (i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+    {
+        uint64_t extent_bytes = (uint64_t)ext->length * fs->sb->block_size;
+        if (offset < extent_bytes)
+        {
+            *contiguous = extent_bytes - offset;
+            return get_block(fs, ext->start) + offset;
+        }
+        offset -= extent_bytes;
+    }
+    return NULL;
+}
+
+// Helper function that checks the block holding byte offset of a file, if the file has one there, against its
+// checksum. Returns 0 or -EIO.
+static int verifyFileBlock(mfs_t *fs, struct inode *inode_ptr, uint64_t offset)
+{
+    size_t   run;
+    uint8_t *in = offset < inode_ptr->file_size ? fileBytes(fs, inode_ptr, offset, &run) : NULL;
+    return in ? verifyBytes(fs, in, 1) : 0;
+}
+
+// Helper function that copies up to count bytes starting at offset out of a file's blocks as they are stored,
+// copying the part of each extent that overlaps the range in one go. Returns the number of bytes copied, or
+// -EIO if a block fails its checksum.
+static ssize_t readExtents(mfs_t *fs, struct inode *inode_ptr, void *buf, size_t count, uint64_t offset)
+{
+    uint8_t *out = buf;
+    size_t   done = 0;
+    while (done < count)
+    {
+        size_t   run;
+        uint8_t *in = fileBytes(fs, inode_ptr, offset + done, &run);
+        if (!in)
+        {
+            break;
+        }
+        if (run > count - done)
+        {
+            run = count - done;
+        }
+        if (verifyBytes(fs, in, run) < 0)
+        {
+            return -EIO;
+        }
+        memcpy(out + done, in, run);
+
+        size_t at = in - fs->data;
+        noteCached(fs, at / fs->sb->block_size, blocksFor(at % fs->sb->block_size + run, fs->sb->block_size), 1);
+        done += run;
+    }
+    return done;
+}
+
+// Helper function that copies count bytes starting at offset out of a compressed file, all of which must be
+// inside it. Only the chunks overlapping the range are read, and a chunk that was stored as it was is copied
+// straight out. Returns the number of bytes copied, -EIO if the file is damaged or -ENOMEM.
+static ssize_t readCompressed(mfs_t *fs, struct inode *inode_ptr, void *buf, size_t count, uint64_t offset)
+{
+    uint8_t *out = buf;
+    uint8_t *packed = NULL;
+    uint8_t *plain = NULL;
+    ssize_t  status = 0;
+    size_t   done = 0;
+
+    while (done < count && status == 0)
+    {
+        uint64_t chunk = (offset + done) / COMPRESS_CHUNK;
+        uint64_t chunk_start = chunk * COMPRESS_CHUNK;
+        size_t   len = inode_ptr->file_size - chunk_start < COMPRESS_CHUNK ? inode_ptr->file_size - chunk_start : COMPRESS_CHUNK;
+        size_t   skip = offset + done - chunk_start;
+        size_t   wanted = len - skip < count - done ? len - skip : count - done;
+        uint32_t bounds[2];
+
+        if (readExtents(fs, inode_ptr, bounds, sizeof(bounds), chunk * sizeof(uint32_t)) != sizeof(bounds) ||
+            bounds[1] < bounds[0] || bounds[1] - bounds[0] > len)
+        {
+            status = -EIO;
+        }
+        else if (bounds[1] - bounds[0] == len)
+        {
+            status = readExtents(fs, inode_ptr, out + done, wanted, bounds[0] + skip) == wanted ? 0 : -EIO;
+        }
+        else if (!packed && (!(packed = malloc(COMPRESS_CHUNK)) || !(plain = malloc(COMPRESS_CHUNK))))
+        {
+            status = -ENOMEM;
+        }
+        else if (readExtents(fs, inode_ptr, packed, bounds[1] - bounds[0], bounds[0]) != bounds[1] - bounds[0] ||
+                 decompressChunk(packed, bounds[1] - bounds[0], plain, len) < 0)
+        {
+            status = -EIO;
+        }
+        else
+        {
+            memcpy(out + done, plain + skip, wanted);
+        }
+        done += wanted;
+    }
+
+    free(packed);
+    free(plain);
+    return status < 0 ? status : (ssize_t)done;
+}
+
+// Helper function that keeps a file read sequentially ahead of its reader. A read that starts where the
+// last one ended asks the kernel for the next window of the file with MADV_WILLNEED, and each one that
+// carries on doubles the window. Compressed files are read a chunk at a time already and are left alone.
+static void readAhead(mfs_t *fs, struct inode *inode_ptr, uint64_t offset, size_t count)
+{
+    int32_t  inode = inode_ptr - fs->inodes;
+    uint64_t from, to;
+
+    if (inode_ptr->attribute & MFS_ATTR_COMPRESSED)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&fs->cache_lock);
+    if (inode == fs->stream_inode && offset == fs->stream_end)
+    {
+        fs->stream_window = fs->stream_window ? fs->stream_window * 2 : READAHEAD_MIN;
+        if (fs->stream_window > READAHEAD_MAX)
+        {
+            fs->stream_window = READAHEAD_MAX;
+        }
+    }
+    else
+    {
+        fs->stream_window = 0;
+        fs->stream_ahead  = 0;
+    }
+    fs->stream_inode = inode;
+    fs->stream_end   = offset + count;
+
+    // only the part of the window not asked for already
+    from = fs->stream_ahead > fs->stream_end ? fs->stream_ahead : fs->stream_end;
+    to   = fs->stream_end + fs->stream_window;
+    if (to > inode_ptr->file_size)
+    {
+        to = inode_ptr->file_size;
+    }
+    if (fs->stream_window == 0 || to <= from)
+    {
+        from = to;
+    }
+    else
+    {
+        fs->stream_ahead = to;
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+
+    while (from < to)
+    {
+        size_t   run;
+        uint8_t *in = fileBytes(fs, inode_ptr, from, &run);
+        if (!in)
+        {
+            break;
+        }
+        if (run > to - from)
+        {
+            run = to - from;
+        }
+        adviseRange(fs, in, run, MADV_WILLNEED);
+        from += run;
+    }
+}
+
+// Helper function that copies up to count bytes starting at offset out of a file. Returns the number of
+// bytes copied, or -EIO or -ENOMEM if a compressed file could not be unpacked.
+static ssize_t readInode(mfs_t *fs, struct inode *inode_ptr, void *buf, size_t count, uint64_t offset)
+{
+    if (offset >= inode_ptr->file_size)
+    {
+        return 0;
+    }
+    if (count > inode_ptr->file_size - offset)
+    {
+        count = inode_ptr->file_size - offset;
+    }
+    readAhead(fs, inode_ptr, offset, count);
+
+    ssize_t done = inode_ptr->attribute & MFS_ATTR_COMPRESSED ? readCompressed(fs, inode_ptr, buf, count, offset)
+                                                              : readExtents(fs, inode_ptr, buf, count, offset);
+    if (done > 0)
+    {
+        addCount(&fs->counters.image_bytes_read, done);
+    }
+    return done;
+}
+
+// Helper function that writes the contents of the file in directory slot entry to out_fd.
+// Each extent is contiguous in the image, so it goes out as one kernel-side copy; a compressed
+// file is unpacked a chunk at a time instead. Returns 0 on success and -1 on failure, which
+// includes a block failing its checksum
+static int copyFileOut(mfs_t *fs, int32_t entry, int out_fd)
+{
+    struct inode *inode_ptr = &fs->inodes[fs->directory[entry].inode];
+    uint32_t copy_size = inode_ptr->file_size;
+    struct extent *ext;
+    int j;
+
+    if (inode_ptr->attribute & MFS_ATTR_COMPRESSED)
+    {
+        uint8_t *chunk = malloc(COMPRESS_CHUNK);
+        uint64_t offset;
+        int status = chunk ? 0 : -1;
+        for (offset = 0; status == 0 && offset < copy_size; offset += COMPRESS_CHUNK)
+        {
+            ssize_t n = readInode(fs, inode_ptr, chunk, COMPRESS_CHUNK, offset);
+            status = n < 0 ? -1 : writeAll(out_fd, chunk, n);
+        }
+        free(chunk);
+        if (status == 0)
+        {
+            addCount(&fs->counters.host_bytes_written, copy_size);
+        }
+        return status;
+    }
+    for (j = 0; (ext = getExtent(fs, inode_ptr, j, 0)) && ext->length && copy_size > 0; j++)
+    {
+        size_t num_bytes = (size_t)ext->length * fs->sb->block_size;
+        if (copy_size < num_bytes)
+        {
+            num_bytes = copy_size;
+        }
+
+        // checking the blocks reads them through the mapping, so have the kernel fetch the extent in one go
+        if (fs->checksums && !testBlock(fs->verified_blocks, ext->start))
+        {
+            adviseRange(fs, get_block(fs, ext->start), num_bytes, MADV_WILLNEED);
+        }
+
+        // the kernel copies from the file, so the blocks are checked through the mapping first
+        if (verifyBlocks(fs, ext->start, blocksFor(num_bytes, fs->sb->block_size)) < 0 ||
+            copyBlocksOut(fs, out_fd, ext->start, num_bytes) < 0)
+        {
+            return -1;
+        }
+        copy_size -= num_bytes;
+    }
+    addCount(&fs->counters.image_bytes_read, inode_ptr->file_size);
+    addCount(&fs->counters.host_bytes_written, inode_ptr->file_size);
+    return 0;
+}
+
+// Helper function that copies count bytes into a file starting at offset. The blocks must already
+// be allocated. Returns the number of bytes copied.
+static size_t writeInode(mfs_t *fs, struct inode *inode_ptr, const void *buf, size_t count, uint64_t offset)
+{
+    const uint8_t *in = buf;
+    size_t done = 0;
+    while (done < count)
+    {
+        size_t   run;
+        uint8_t *out = fileBytes(fs, inode_ptr, offset + done, &run);
+        if (!out)
+        {
+            break;
+        }
+        if (run > count - done)
+        {
+            run = count - done;
+        }
+        if (in)
+        {
+            memcpy(out, in + done, run);
+        }
+        else
+        {
+            memset(out, 0, run);
+        }
+        mark_dirty(fs, out, run);
+        done += run;
+    }
+    return done;
+}
+
+// Helper function that makes sure the first blocks blocks of a file are allocated. The last extent
+// grows in place while the blocks after it are free, so a file written a little at a time stays
+// contiguous; the rest comes from best-fitting runs. New blocks are zeroed, which keeps every byte
+// past the end of a file zero. Returns 0 on success and -ENOSPC if the blocks could not be found,
+// in which case nothing is allocated.
+static int growFile(mfs_t *fs, int32_t inode, int32_t blocks)
+{
+    struct inode  *inode_ptr = &fs->inodes[inode];
+    struct extent *ext;
+    struct extent *last = NULL;
+    int32_t have = 0;
+    int32_t i;
+
+    for (i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+    {
+        have += ext->length;
+        last = ext;
+    }
+    if (blocks <= have)
+    {
+        return 0;
+    }
+    if (blocks - have > fs->free_block_count)
+    {
+        return -ENOSPC;
+    }
+
+    int32_t old_have   = have;
+    int32_t old_length = last ? last->length : 0;
+    int32_t next       = last ? last->start + last->length : fs->sb->num_blocks;
+
+    // only into blocks the last save did not use either, like findFreeRun
+    if (next < fs->sb->num_blocks && nextBlockIn(fs, next, 1, 1) == next)
+    {
+        int32_t end = nextBlockIn(fs, next, 0, 1);
+        for (; next < end && have < blocks; next++, have++)
+        {
+            claimBlock(fs, next);
+            last->length++;
+        }
+        mark_dirty(fs, last, sizeof(struct extent));
+    }
+
+    if (have < blocks && allocateExtents(fs, inode, blocks - have) < 0)
+    {
+        // give back the blocks the last extent grew into
+        while (last && last->length > old_length)
+        {
+            last->length--;
+            releaseBlock(fs, last->start + last->length);
+        }
+        return -ENOSPC;
+    }
+
+    writeInode(fs, inode_ptr, NULL, (size_t)(blocks - old_have) * fs->sb->block_size, (uint64_t)old_have * fs->sb->block_size);
+    return 0;
+}
+
+// Helper function that replaces a file's blocks with new ones holding the len bytes in buf and sets its
+// attribute byte, leaving the file size alone. The old blocks may all be shared with snapshots or other
+// files, so the new ones have to fit beside them, and are only released once the new ones are in place.
+// Returns 0 or -ENOSPC, in which case nothing changes.
+static int rewriteFile(mfs_t *fs, int32_t inode, const uint8_t *buf, size_t len, uint8_t attribute)
+{
+    struct inode *inode_ptr = &fs->inodes[inode];
+    int32_t blocks = blocksFor(len, fs->sb->block_size);
+
+    if (blocks + mapBlocksFor(fs, blocks) > fs->free_block_count)
+    {
+        return -ENOSPC;
+    }
+
+    struct inode old = *inode_ptr;
+    resetExtents(fs, inode_ptr);
+    int status = growFile(fs, inode, blocks);
+    if (status < 0)
+    {
+        // growFile gave back what it took, and the old blocks were never released
+        *inode_ptr = old;
+        mark_dirty(fs, inode_ptr, sizeof(struct inode));
+        return status;
+    }
+
+    setExtentsUsed(fs, &old, 0);
+    writeInode(fs, inode_ptr, buf, len, 0);
+    inode_ptr->file_size = old.file_size;
+    inode_ptr->attribute = attribute;
+    mark_dirty(fs, inode_ptr, sizeof(struct inode));
+    return 0;
+}
+
+// Helper function that stores a file in the compressed layout. A file that would not shrink by a block
+// stays as it is. Returns 0, -ENOSPC, -ENOMEM or -EIO.
+static int compressInode(mfs_t *fs, int32_t inode)
+{
+    struct inode *inode_ptr = &fs->inodes[inode];
+    uint8_t *raw = malloc(inode_ptr->file_size ? inode_ptr->file_size : 1);
+    if (!raw)
+    {
+        return -ENOMEM;
+    }
+
+    size_t   packed_size;
+    uint8_t *packed = NULL;
+    int      status = readExtents(fs, inode_ptr, raw, inode_ptr->file_size, 0) < 0 ? -EIO : 0;
+    if (status == 0 && (packed = packFile(raw, inode_ptr->file_size, fs->sb->block_size, &packed_size)))
+    {
+        status = rewriteFile(fs, inode, packed, packed_size, MFS_ATTR_COMPRESSED);
+    }
+    free(packed);
+    free(raw);
+    return status;
+}
+
+// Helper function that unpacks a compressed file back into plain blocks, which handles can write to.
+// Returns 0, -ENOSPC, -ENOMEM or -EIO.
+static int expandInode(mfs_t *fs, int32_t inode)
+{
+    struct inode *inode_ptr = &fs->inodes[inode];
+    uint8_t *raw = malloc(inode_ptr->file_size ? inode_ptr->file_size : 1);
+    if (!raw)
+    {
+        return -ENOMEM;
+    }
+
+    ssize_t status = readInode(fs, inode_ptr, raw, inode_ptr->file_size, 0);
+    if (status >= 0)
+    {
+        status = rewriteFile(fs, inode, raw, inode_ptr->file_size, 0);
+    }
+    free(raw);
+    return status;
+}
+
+// Helper function that opens up n slots at extent number at by moving every extent from there on
+// back by n. Returns 0 on success and -1 if an indirect block for the longer list could not be found
+static int insertExtentSlots(mfs_t *fs, struct inode *inode_ptr, int32_t at, int32_t n)
+{
+    int32_t count = countExtents(fs, inode_ptr);
+    int32_t i;
+
+    // make room at the end before moving anything, so running out of space leaves the list as it was
+    for (i = count; i < count + n; i++)
+    {
+        if (!getExtent(fs, inode_ptr, i, 1))
+        {
+            return -1;
+        }
+    }
+    for (i = count - 1; i >= at; i--)
+    {
+        struct extent *to = getExtent(fs, inode_ptr, i + n, 0);
+        *to = *getExtent(fs, inode_ptr, i, 0);
+        mark_dirty(fs, to, sizeof(struct extent));
+    }
+    return 0;
+}
+
+// Helper function that gives a file its own copy of every block from file block first through last
+// that a snapshot shares, so writing to them cannot change the snapshot. Each shared stretch moves to
+// a run of its own and the extent it was in is split around it. Returns 0 on success and -ENOSPC if
+// the disk fills up, leaving whatever was copied before that in place.
+static int unshareBlocks(mfs_t *fs, struct inode *inode_ptr, int32_t first, int32_t last)
+{
+    struct extent *ext;
+    int32_t n = 0;
+    int32_t pos = 0;    // the file block extent n starts at
+
+    if (!fs->refcounts)
+    {
+        return 0;
+    }
+
+    while (pos <= last && (ext = getExtent(fs, inode_ptr, n, 0)) && ext->length)
+    {
+        int32_t from = first > pos ? first - pos : 0;
+        int32_t to   = last - pos < ext->length ? last - pos + 1 : ext->length;
+        while (from < to && fs->refcounts[ext->start + from] <= 1)
+        {
+            from++;
+        }
+        if (from >= to)
+        {
+            pos += ext->length;
+            n++;
+            continue;
+        }
+
+        int32_t end = from;
+        while (end < to && fs->refcounts[ext->start + end] > 1)
+        {
+            end++;
+        }
+
+        int32_t length;
+        int32_t run = findFreeRun(fs, end - from, &length);
+        if (run == -1)
+        {
+            return -ENOSPC;
+        }
+        if (length > end - from)
+        {
+            length = end - from;
+        }
+
+        // claim the run before the extent list grows, which may need blocks of its own
+        struct extent old = *ext;
+        int32_t pieces = (from > 0) + 1 + (from + length < old.length);
+        int32_t j;
+        for (j = 0; j < length; j++)
+        {
+            claimBlock(fs, run + j);
+        }
+        if (insertExtentSlots(fs, inode_ptr, n, pieces - 1) < 0)
+        {
+            for (j = 0; j < length; j++)
+            {
+                releaseBlock(fs, run + j);
+            }
+            return -ENOSPC;
+        }
+
+        memcpy(get_block(fs, run), get_block(fs, old.start + from), (size_t)length * fs->sb->block_size);
+        mark_dirty(fs, get_block(fs, run), (size_t)length * fs->sb->block_size);
+        for (j = 0; j < length; j++)
+        {
+            releaseBlock(fs, old.start + from + j);
+        }
+
+        struct extent split[3];
+        int32_t count = 0;
+        if (from > 0)
+        {
+            split[count++] = (struct extent){ old.start, from };
+        }
+        split[count++] = (struct extent){ run, length };
+        if (from + length < old.length)
+        {
+            split[count++] = (struct extent){ old.start + from + length, old.length - from - length };
+        }
+        for (j = 0; j < count; j++)
+        {
+            ext = getExtent(fs, inode_ptr, n + j, 0);
+            *ext = split[j];
+            mark_dirty(fs, ext, sizeof(struct extent));
+        }
+
+        // carry on with the tail, if there is one
+        pos += from + length;
+        n   += (from > 0) + 1;
+    }
+    return 0;
+}
+
+// Helper function that returns a fresh block holding a copy of block. The caller makes sure a block is free.
+static int32_t copyBlock(mfs_t *fs, int32_t block)
+{
+    int32_t copy = findFreeBlock(fs);
+    claimBlock(fs, copy);
+    memcpy(get_block(fs, copy), get_block(fs, block), fs->sb->block_size);
+    mark_dirty(fs, get_block(fs, copy), fs->sb->block_size);
+    return copy;
+}
+
+// Helper function that points an inode at copies of its indirect blocks, so that an inode copied out of
+// or into a snapshot never shares an extent list that either side may change. inode_ptr itself is not
+// marked dirty, since it may be a copy outside the image. The caller makes sure there are enough free
+// blocks for countMapBlocks copies.
+static void copyMapBlocks(mfs_t *fs, struct inode *inode_ptr)
+{
+    if (inode_ptr->indirect != -1)
+    {
+        inode_ptr->indirect = copyBlock(fs, inode_ptr->indirect);
+    }
+    if (inode_ptr->double_indirect != -1)
+    {
+        inode_ptr->double_indirect = copyBlock(fs, inode_ptr->double_indirect);
+
+        int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+        int32_t i;
+        for (i = 0; i < POINTERS_PER_BLOCK && pointers[i] != -1; i++)
+        {
+            pointers[i] = copyBlock(fs, pointers[i]);
+        }
+    }
+}
+
+// Helper function that adds a reference to every data block of a file
+static void shareExtents(mfs_t *fs, struct inode *inode_ptr)
+{
+    struct extent *ext;
+    int32_t i;
+    for (i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+    {
+        int32_t j;
+        for (j = 0; j < ext->length; j++)
+        {
+            fs->refcounts[ext->start + j]++;
+        }
+        mark_dirty(fs, &fs->refcounts[ext->start], ext->length * sizeof(uint16_t));
+    }
+}
+
+// Helper function that returns the number of blocks in the part of the metadata a snapshot copies: the
+// directory, the free inode map and the inode table, which sit next to each other
+static int32_t snapshotBlocks(mfs_t *fs)
+{
+    return fs->sb->free_map_block - fs->sb->directory_block;
+}
+
+// Helper function that copies a snapshot's metadata into buf (save is 0) or buf into the snapshot (save is 1)
+static void moveSnapshot(mfs_t *fs, struct snapshotEntry *snap, uint8_t *buf, int save)
+{
+    size_t offset = 0;
+    int i;
+    for (i = 0; i < SNAPSHOT_EXTENTS && snap->copy[i].length; i++)
+    {
+        size_t   bytes = (size_t)snap->copy[i].length * fs->sb->block_size;
+        uint8_t *block = get_block(fs, snap->copy[i].start);
+        if (save)
+        {
+            memcpy(block, buf + offset, bytes);
+            mark_dirty(fs, block, bytes);
+        }
+        else
+        {
+            memcpy(buf + offset, block, bytes);
+        }
+        offset += bytes;
+    }
+}
+
+// Helper function that checks the blocks holding a snapshot's metadata copy against their checksums.
+// Returns 0 or -EIO.
+static int verifySnapshot(mfs_t *fs, struct snapshotEntry *snap)
+{
+    int i;
+    for (i = 0; i < SNAPSHOT_EXTENTS && snap->copy[i].length; i++)
+    {
+        if (verifyBlocks(fs, snap->copy[i].start, snap->copy[i].length) < 0)
+        {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+// Helper function that returns the inode table inside a buffer holding a snapshot's metadata
+static struct inode *snapshotInodes(mfs_t *fs, uint8_t *buf)
+{
+    return (struct inode *)(buf + (size_t)(fs->sb->inode_block - fs->sb->directory_block) * fs->sb->block_size);
+}
+
+// Helper function that returns the snapshot called name, or NULL if there is none
+static struct snapshotEntry *findSnapshot(mfs_t *fs, const char *name)
+{
+    int i;
+    for (i = 0; i < MAX_SNAPSHOTS; i++)
+    {
+        if (fs->snapshots[i].in_use && strncmp(fs->snapshots[i].name, name, 64) == 0)
+        {
+            return &fs->snapshots[i];
+        }
+    }
+    return NULL;
+}
+
+// Helper function that claims the blocks a snapshot's metadata copy will live in, as up to SNAPSHOT_EXTENTS
+// runs. Returns 0 on success and -ENOSPC, with nothing claimed, if the free space is too scattered.
+static int allocateSnapshot(mfs_t *fs, struct snapshotEntry *snap)
+{
+    int32_t wanted = snapshotBlocks(fs);
+    int i;
+
+    memset(snap->copy, 0, sizeof(snap->copy));
+    for (i = 0; i < SNAPSHOT_EXTENTS && wanted > 0; i++)
+    {
+        int32_t length;
+        int32_t start = findFreeRun(fs, wanted, &length);
+        if (start == -1)
+        {
+            break;
+        }
+        if (length > wanted)
+        {
+            length = wanted;
+        }
+
+        int32_t j;
+        for (j = 0; j < length; j++)
+        {
+            claimBlock(fs, start + j);
+        }
+        snap->copy[i].start  = start;
+        snap->copy[i].length = length;
+        wanted -= length;
+    }
+
+    if (wanted > 0)
+    {
+        for (i = 0; i < SNAPSHOT_EXTENTS && snap->copy[i].length; i++)
+        {
+            int32_t j;
+            for (j = 0; j < snap->copy[i].length; j++)
+            {
+                releaseBlock(fs, snap->copy[i].start + j);
+            }
+        }
+        memset(snap->copy, 0, sizeof(snap->copy));
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+// a file written out by extract-all, and how that went
+struct pendingExtract
+{
+    int32_t entry;
+    int     status;
+};
+
+// the files of one extract-all. Workers take the next file to write from next.
+struct extractBatch
+{
+    mfs_t *fs;
+    struct pendingExtract *files;
+    int         count;
+    int         next;
+    const char *destdir;
+};
+
+// Helper function that creates every missing parent directory of path
+static void makeParents(char *path)
+{
+    char *slash;
+    for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+// Helper function that returns 1 if a file name would land outside the destination directory
+static int escapesDestdir(const char *name)
+{
+    const char *part = name;
+    while (part)
+    {
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0'))
+        {
+            return 1;
+        }
+        part = strchr(part, '/');
+        if (part)
+        {
+            part++;
+        }
+    }
+    return 0;
+}
+
+// Worker thread body: writes files out until the batch runs out. The caller holds the image
+// lock for reading, so workers need no locking beyond taking the next file.
+static void *extractWorker(void *arg)
+{
+    struct extractBatch *batch = arg;
+    mfs_t *fs = batch->fs;
+    int i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+    {
+        struct pendingExtract *pending = &batch->files[i];
+        char path[4096];
+
+        snprintf(path, sizeof(path), "%s/%s", batch->destdir, fs->directory[pending->entry].filename);
+        makeParents(path);
+
+        int out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0)
+        {
+            pending->status = -errno;
+            continue;
+        }
+        pending->status = copyFileOut(fs, pending->entry, out_fd) < 0 ? -EIO : 0;
+        close(out_fd);
+        trimCache(fs);
+    }
+    return NULL;
+}
+
+// Helper function that runs body on up to threads threads, the calling thread included
+static void runWorkers(void *(*body)(void *), void *arg, long threads)
+{
+    pthread_t *workers = threads > 1 ? malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    int i;
+
+    while (workers && started < threads - 1 && pthread_create(&workers[started], NULL, body, arg) == 0)
+    {
+        started++;
+    }
+    body(arg);
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+}
+
+// a scrub of the whole image. Workers take SCRUB_BLOCKS blocks at a time from next.
+struct scrubBatch
+{
+    mfs_t    *fs;
+    int64_t   next;
+    int32_t   damaged;
+    uint64_t *bad;          // one bit per block that failed its checksum
+};
+
+// Worker thread body: checks blocks in use against their checksums until the image runs out. Unlike reads,
+// it checks blocks that have been verified before. The caller holds the image lock for reading.
+static void *scrubWorker(void *arg)
+{
+    struct scrubBatch *batch = arg;
+    mfs_t *fs = batch->fs;
+    int64_t start;
+    while ((start = __atomic_fetch_add(&batch->next, SCRUB_BLOCKS, __ATOMIC_RELAXED)) < fs->sb->num_blocks)
+    {
+        int32_t end = start + SCRUB_BLOCKS < fs->sb->num_blocks ? start + SCRUB_BLOCKS : fs->sb->num_blocks;
+        int32_t block;
+        for (block = start; block < end; block++)
+        {
+            if (testBlock(fs->free_blocks, block) || is_dirty(fs, block) || !hasChecksum(fs, block))
+            {
+                continue;
+            }
+            if (crc32c(get_block(fs, block), fs->sb->block_size) == fs->checksums[block])
+            {
+                __atomic_fetch_or(&fs->verified_blocks[block / 64], 1ULL << (block % 64), __ATOMIC_RELAXED);
+            }
+            else
+            {
+                __atomic_fetch_or(&batch->bad[block / 64], 1ULL << (block % 64), __ATOMIC_RELAXED);
+                __atomic_fetch_add(&batch->damaged, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        // a scrub would otherwise leave the whole image in memory
+        noteCached(fs, start, end - start, 0);
+        trimCache(fs);
+    }
+    return NULL;
+}
+
+// Helper function that returns 1 if any of blocks start through start + count - 1 is set in bad
+static int anyBad(const uint64_t *bad, int32_t start, int32_t count)
+{
+    int32_t block;
+    for (block = start; block < start + count; block++)
+    {
+        if (testBlock(bad, block))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function that returns 1 if any block of a file, indirect blocks included, is set in bad. The
+// extent list is only walked once the blocks holding it are known to be good.
+static int fileDamaged(mfs_t *fs, struct inode *inode_ptr, const uint64_t *bad)
+{
+    struct extent *ext;
+    int32_t i;
+
+    if ((inode_ptr->indirect != -1 && testBlock(bad, inode_ptr->indirect)) ||
+        (inode_ptr->double_indirect != -1 && testBlock(bad, inode_ptr->double_indirect)))
+    {
+        return 1;
+    }
+    if (inode_ptr->double_indirect != -1)
+    {
+        int32_t *pointers = (int32_t *)get_block(fs, inode_ptr->double_indirect);
+        for (i = 0; i < POINTERS_PER_BLOCK && pointers[i] != -1; i++)
+        {
+            if (testBlock(bad, pointers[i]))
+            {
+                return 1;
+            }
+        }
+    }
+    for (i = 0; (ext = getExtent(fs, inode_ptr, i, 0)) && ext->length; i++)
+    {
+        if (anyBad(bad, ext->start, ext->length))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function that returns the number of threads to spread count jobs over, at most limit
+static long workerCount(int count, long limit)
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (limit > 0 && threads > limit)
+    {
+        threads = limit;
+    }
+    return threads > count ? count : threads;
+}
+
+// Helper function that returns a new handle for the image open on fd, with nothing mapped yet
+static mfs_t *newHandle(int fd)
+{
+    mfs_t *fs = calloc(1, sizeof(mfs_t));
+    if (!fs)
+    {
+        return NULL;
+    }
+    if (pthread_rwlock_init(&fs->lock, NULL) != 0)
+    {
+        free(fs);
+        return NULL;
+    }
+    if (pthread_mutex_init(&fs->cache_lock, NULL) != 0)
+    {
+        pthread_rwlock_destroy(&fs->lock);
+        free(fs);
+        return NULL;
+    }
+    fs->image_fd     = fd;
+    fs->stream_inode = -1;
+    return fs;
+}
+
+// Helper function that releases everything a handle holds, including the handle itself
+static void freeHandle(mfs_t *fs)
+{
+    unmap_image(fs);
+    ringTeardown(fs->ring);
+    pthread_mutex_destroy(&fs->cache_lock);
+    pthread_rwlock_destroy(&fs->lock);
+    free(fs);
+}
+
+
+/*************************************** LIBRARY FUNCTIONS ********************************************/
+
+/* mfs_createfs creates a new disk image of image_size bytes made of block_size byte blocks with room for
+   num_files files (0 picks one file per BLOCKS_PER_INODE blocks), writes a superblock recording that geometry and
+   initializes its structures to the appropriate values. The image file is sized with ftruncate, so it starts out
+   as all zeros without us having to write them.
+*/
+int mfs_createfs(mfs_t **handle, const char *filename, size_t image_size, int32_t block_size, int32_t num_files)
+{
+    struct superblock super;
+
+    if(!validBlockSize(block_size))
+    {
+        return -EINVAL;
+    }
+
+    super.magic      = MFS_MAGIC;
+    super.block_size = block_size;
+    super.num_blocks = image_size / block_size > INT32_MAX ? INT32_MAX : (int32_t)(image_size / block_size);
+    super.num_files  = num_files > 0 ? num_files : super.num_blocks / BLOCKS_PER_INODE;
+    if(super.num_files < 1)
+    {
+        super.num_files = 1;
+    }
+
+    if(layoutImage(&super) < 0)
+    {
+        return -ERANGE;
+    }
+
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		return -errno;
+	}
+
+	mfs_t *fs = newHandle(fd);
+	if(!fs)
+	{
+		close(fd);
+		return -ENOMEM;
+	}
+
+	image_size = (size_t)super.num_blocks * super.block_size;
+	if(ftruncate(fd, image_size) < 0 || map_image(fs, image_size) < 0)
+	{
+		int status = -errno;
+		freeHandle(fs);
+		return status;
+	}
+
+	*fs->sb = super;
+	if(attach_regions(fs) < 0)
+	{
+		freeHandle(fs);
+		return -ENOMEM;
+	}
+
+    //All inode blocks are also set to -1, indicating that they are not being used.
+	int i;
+	for(i = 0; i < fs->sb->num_files; i++)
+	{
+		fs->directory[i].in_use     = 0;
+		fs->directory[i].inode      = -1;
+        fs->directory[i].hidden     = 0;
+        fs->directory[i].readOnly   = 0;
+		fs->free_inodes[i] 		    = 1;
+
+		memset(fs->directory[i].filename, 0, 64);
+
+		int j;
+		for(j = 0; j < DIRECT_EXTENTS; j++)
+		{
+			fs->inodes[i].extents[j].start  = -1;
+			fs->inodes[i].extents[j].length = 0;
+		}
+		fs->inodes[i].indirect        = -1;
+		fs->inodes[i].double_indirect = -1;
+		fs->inodes[i].in_use 	= 0;
+		fs->inodes[i].attribute = 0;
+		fs->inodes[i].file_size = 0;
+	}
+
+    // sets all data blocks to be free by setting the corresponding bits in the free_blocks bitmap.
+	int32_t block;
+	memset(fs->free_blocks, 0, FREE_MAP_WORDS * sizeof(uint64_t));
+	for(block = fs->sb->first_data_block; block < fs->sb->num_blocks; block++)
+	{
+		fs->free_blocks[block / 64] |= 1ULL << (block % 64);
+	}
+	countFreeBlocks(fs);
+	rebuildNameIndex(fs);
+
+	mark_dirty(fs, fs->sb, sizeof(struct superblock));
+	mark_dirty(fs, fs->directory, fs->sb->num_files * sizeof(struct directoryEntry));
+	mark_dirty(fs, fs->free_inodes, fs->sb->num_files);
+	mark_dirty(fs, fs->inodes, fs->sb->num_files * sizeof(struct inode));
+	mark_dirty(fs, fs->free_blocks, FREE_MAP_WORDS * sizeof(uint64_t));
+
+	// the reference counts and snapshot table start out as zeros, but their checksums still have to be recorded
+	mark_dirty(fs, get_block(fs, fs->sb->refcount_block), (size_t)(fs->sb->checksum_block - fs->sb->refcount_block) * fs->sb->block_size);
+	fs->fresh = 1;
+
+	*handle = fs;
+	return 0;
+}
+
+/* mfs_openfs maps the specified disk image. Only the metadata is read up front, to check it
+   against its checksums; file blocks are faulted in from the file the first time they are touched.
+*/
+int mfs_openfs(mfs_t **handle, const char *filename)
+{
+	int fd = open(filename, O_RDWR);
+	if(fd < 0)
+	{
+		return -errno;
+	}
+
+	// a save that crashed after committing its journal is finished before anything reads the image
+	int status = replayJournal(fd);
+	if(status < 0)
+	{
+		close(fd);
+		return status;
+	}
+
+	mfs_t *fs = newHandle(fd);
+	if(!fs)
+	{
+		close(fd);
+		return -ENOMEM;
+	}
+
+	// the geometry comes from the superblock, which also tells us the file is long
+	// enough that touching any block won't SIGBUS
+	struct stat buf;
+	if(fstat(fd, &buf) < 0 || buf.st_size < (off_t)sizeof(struct superblock) || map_image(fs, buf.st_size) < 0 ||
+	   !validSuperblock(fs, buf.st_size))
+	{
+		freeHandle(fs);
+		return -EINVAL;
+	}
+
+	if(attach_regions(fs) < 0)
+	{
+		freeHandle(fs);
+		return -ENOMEM;
+	}
+	if(verifyMetadata(fs) < 0)
+	{
+		freeHandle(fs);
+		return -EIO;
+	}
+
+	countFreeBlocks(fs);
+	rebuildNameIndex(fs);
+	memcpy(fs->saved_free, fs->free_blocks, FREE_MAP_WORDS * sizeof(uint64_t));
+	memcpy(fs->freed_blocks, fs->free_blocks, FREE_MAP_WORDS * sizeof(uint64_t));
+
+	*handle = fs;
+	return 0;
+}
+
+/* mfs_savefs writes back everything changed since the last save. This includes any inserts, deletes,
+   undeletes, attributes, etc. Only the blocks modified since the last save are written, through the
+   journal once the image has been saved once, and the save returns when they are on disk. Zero blocks
+   and blocks freed since the last save are punched out of the file instead, keeping it sparse.
+*/
+int mfs_savefs(mfs_t *fs)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+	int status = saveImage(fs) < 0 ? -errno : 0;
+	trimCache(fs);
+	pthread_rwlock_unlock(&fs->lock);
+	return status;
+}
+
+/* mfs_closefs unmaps the image and closes its descriptor, discarding any unsaved changes. */
+void mfs_closefs(mfs_t *fs)
+{
+	if(fs)
+	{
+		freeHandle(fs);
+	}
+}
+
+/* mfs_df returns the amount of free space in the file system in bytes. The free block count
+   is kept up to date by every allocation, so nothing needs to be scanned. */
+uint64_t mfs_df(mfs_t *fs)
+{
+	pthread_rwlock_rdlock(&fs->lock);
+	uint64_t free_bytes = (uint64_t)fs->free_block_count * fs->sb->block_size;
+	pthread_rwlock_unlock(&fs->lock);
+	return free_bytes;
+}
+
+/* mfs_set_cache_size sets the limit of the block cache, dropping blocks straight away if the cache is over it.
+   Blocks only count once they are read or saved with a limit in place. */
+int mfs_set_cache_size(mfs_t *fs, size_t bytes)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+
+    int     status = 0;
+    size_t  page   = sysconf(_SC_PAGESIZE);
+    int32_t unit_blocks = page > (size_t)fs->sb->block_size ? (int32_t)(page / fs->sb->block_size) : 1;
+    int32_t units  = (fs->sb->num_blocks + unit_blocks - 1) / unit_blocks;
+    size_t  limit  = bytes / ((size_t)unit_blocks * fs->sb->block_size);
+
+    if (bytes > 0 && !fs->cached_units)
+    {
+        fs->cached_units     = calloc((units + 63) / 64, sizeof(uint64_t));
+        fs->referenced_units = calloc((units + 63) / 64, sizeof(uint64_t));
+        fs->unit_blocks      = unit_blocks;
+        fs->cache_count      = 0;
+        fs->cache_hand       = 0;
+    }
+    if (bytes == 0 || !fs->cached_units || !fs->referenced_units)
+    {
+        status = bytes == 0 ? 0 : -ENOMEM;
+        free(fs->cached_units);
+        free(fs->referenced_units);
+        fs->cached_units     = NULL;
+        fs->referenced_units = NULL;
+        fs->cache_limit      = 0;
+    }
+    else
+    {
+        fs->cache_limit = limit < 1 ? 1 : limit > (size_t)units ? units : (int32_t)limit;
+        trimCache(fs);
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    return status;
+}
+
+/* mfs_get_counters copies the running totals of the handle. They are only ever added to, each on its
+   own, so they are read one at a time without the lock and a call racing with others may see one
+   total a little ahead of another. */
+void mfs_get_counters(mfs_t *fs, struct mfs_counters *counters)
+{
+	counters->image_bytes_read    = __atomic_load_n(&fs->counters.image_bytes_read, __ATOMIC_RELAXED);
+	counters->image_bytes_written = __atomic_load_n(&fs->counters.image_bytes_written, __ATOMIC_RELAXED);
+	counters->saved_bytes         = __atomic_load_n(&fs->counters.saved_bytes, __ATOMIC_RELAXED);
+	counters->host_bytes_read     = __atomic_load_n(&fs->counters.host_bytes_read, __ATOMIC_RELAXED);
+	counters->host_bytes_written  = __atomic_load_n(&fs->counters.host_bytes_written, __ATOMIC_RELAXED);
+	counters->blocks_allocated    = __atomic_load_n(&fs->counters.blocks_allocated, __ATOMIC_RELAXED);
+	counters->blocks_freed        = __atomic_load_n(&fs->counters.blocks_freed, __ATOMIC_RELAXED);
+	counters->lookups             = __atomic_load_n(&fs->counters.lookups, __ATOMIC_RELAXED);
+}
+
+// Helper function that fills in an mfs_stat from a directory entry
+static void statEntry(mfs_t *fs, int32_t i, struct mfs_stat *st)
+{
+	memset(st, 0, sizeof(struct mfs_stat));
+	memcpy(st->name, fs->directory[i].filename, MFS_NAME_MAX);
+	st->size       = fs->inodes[fs->directory[i].inode].file_size;
+	st->attributes = (fs->directory[i].hidden ? MFS_ATTR_HIDDEN : 0) | (fs->directory[i].readOnly ? MFS_ATTR_READONLY : 0) |
+	                 (fs->inodes[fs->directory[i].inode].attribute & MFS_ATTR_COMPRESSED);
+}
+
+int mfs_stat(mfs_t *fs, const char *name, struct mfs_stat *st)
+{
+	pthread_rwlock_rdlock(&fs->lock);
+	int32_t i = findFile(fs, name, 1);
+	if(i != -1)
+	{
+		statEntry(fs, i, st);
+	}
+	pthread_rwlock_unlock(&fs->lock);
+	return i == -1 ? -ENOENT : 0;
+}
+
+int mfs_readdir(mfs_t *fs, int32_t *cursor, struct mfs_stat *st)
+{
+	int found = 0;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	while(!found && *cursor < fs->sb->num_files)
+	{
+		int32_t i = (*cursor)++;
+		if(fs->directory[i].in_use)
+		{
+			statEntry(fs, i, st);
+			found = 1;
+		}
+	}
+	pthread_rwlock_unlock(&fs->lock);
+	return found;
+}
+
+/* mfs_read_file copies bytes out of a file by name, without needing a handle. */
+ssize_t mfs_read_file(mfs_t *fs, const char *name, void *buf, size_t count, uint64_t offset)
+{
+	pthread_rwlock_rdlock(&fs->lock);
+
+	ssize_t copied = -ENOENT;
+	int32_t i = findFile(fs, name, 1);
+	if(i != -1)
+	{
+		copied = readInode(fs, &fs->inodes[fs->directory[i].inode], buf, count, offset);
+	}
+	trimCache(fs);
+
+	pthread_rwlock_unlock(&fs->lock);
+	return copied;
+}
+
+/* mfs_insert checks the whole batch and allocates its space before any file is read. The files
+   are then copied in by up to MAX_READER_THREADS threads, each writing only its own file's
+   blocks, and the directory is updated once they are all done. With MFS_INSERT_DEDUP the readers also
+   hash every block, and blocks that match one already in the image are shared with it as the files are
+   committed. With MFS_INSERT_COMPRESS each reader packs its file before hashing it, and the blocks
+   the packed file does not need are given back when it is committed.
+*/
+int mfs_insert(mfs_t *fs, char *const *host_paths, int count, int flags, mfs_report_fn report, void *arg)
+{
+    struct insertBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.fs     = fs;
+    batch.report = report;
+    batch.arg    = arg;
+
+    pthread_rwlock_wrlock(&fs->lock);
+
+    int result = 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        glob_t matches;
+        size_t j;
+        glob(host_paths[i], GLOB_NOCHECK, NULL, &matches);
+        for (j = 0; j < matches.gl_pathc; j++)
+        {
+            int status = queueInsert(fs, &batch, matches.gl_pathv[j], flags & MFS_INSERT_RECURSIVE);
+            if (status < 0 && result == 0)
+            {
+                result = status;
+            }
+        }
+        globfree(&matches);
+    }
+
+    if (batch.count > 0)
+    {
+        int status = planInserts(fs, &batch);
+        if (status < 0)
+        {
+            result = status;
+        }
+        else
+        {
+            // images without reference counts cannot share blocks, and without memory for the
+            // index the batch is inserted as it is
+            batch.dedup = (flags & MFS_INSERT_DEDUP) && fs->refcounts &&
+                          (fs->hashed_blocks || buildBlockIndex(fs) == 0);
+            batch.compress = flags & MFS_INSERT_COMPRESS;
+
+            runWorkers(insertReader, &batch, workerCount(batch.count, MAX_READER_THREADS));
+
+            for (i = 0; i < batch.count; i++)
+            {
+                commitInsert(fs, &batch.files[i]);
+                free(batch.files[i].hashes);
+                reportFile(report, arg, batch.files[i].filename, batch.files[i].status);
+                if (batch.files[i].status < 0 && result == 0)
+                {
+                    result = batch.files[i].status;
+                }
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    free(batch.files);
+    return result;
+}
+
+/* mfs_retrieve copies a file out of the disk image into a host file. */
+int mfs_retrieve(mfs_t *fs, const char *name, const char *host_path)
+{
+    pthread_rwlock_rdlock(&fs->lock);
+
+    int status = 0;
+    int32_t i = findFile(fs, name, 1);
+    if (i == -1)
+    {
+        status = -ENOENT;
+    }
+    else
+    {
+        int out_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0)
+        {
+            status = -errno;
+        }
+        else
+        {
+            status = copyFileOut(fs, i, out_fd) < 0 ? -EIO : 0;
+            close(out_fd);
+        }
+    }
+    trimCache(fs);
+
+    pthread_rwlock_unlock(&fs->lock);
+    return status;
+}
+
+/* mfs_extract_all writes every file in the disk image into destdir, which is created if
+   needed, keeping any directories in the file names. Files are spread over one worker thread per
+   core, each copying its files out with copy_file_range. */
+int mfs_extract_all(mfs_t *fs, const char *destdir, mfs_report_fn report, void *arg)
+{
+    if (mkdir(destdir, 0755) < 0 && errno != EEXIST)
+    {
+        return -errno;
+    }
+
+    pthread_rwlock_rdlock(&fs->lock);
+
+    struct extractBatch batch;
+    batch.fs      = fs;
+    batch.files   = malloc(fs->sb->num_files * sizeof(struct pendingExtract));
+    batch.count   = 0;
+    batch.next    = 0;
+    batch.destdir = destdir;
+    if (!batch.files)
+    {
+        pthread_rwlock_unlock(&fs->lock);
+        return -ENOMEM;
+    }
+
+    int result = 0;
+    int i;
+    for (i = 0; i < fs->sb->num_files; i++)
+    {
+        if (!fs->directory[i].in_use)
+        {
+            continue;
+        }
+        if (escapesDestdir(fs->directory[i].filename))
+        {
+            reportFile(report, arg, fs->directory[i].filename, -EPERM);
+            result = result ? result : -EPERM;
+            continue;
+        }
+        batch.files[batch.count].entry  = i;
+        batch.files[batch.count].status = 0;
+        batch.count++;
+    }
+
+    runWorkers(extractWorker, &batch, workerCount(batch.count, 0));
+
+    for (i = 0; i < batch.count; i++)
+    {
+        reportFile(report, arg, fs->directory[batch.files[i].entry].filename, batch.files[i].status);
+        if (batch.files[i].status < 0 && result == 0)
+        {
+            result = batch.files[i].status;
+        }
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    free(batch.files);
+    return result;
+}
+
+/* mfs_delete sets the in_use flags of a file's directory entry and inode to 0 and frees its blocks.
+   The extent list is left alone so the file can still be undeleted until its space is reused.
+*/
+int mfs_delete(mfs_t *fs, const char *name)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+
+    int status = 0;
+    int32_t i = findFile(fs, name, 1);
+    if (i == -1)
+    {
+        status = -ENOENT;
+    }
+    else if (fs->directory[i].readOnly)
+    {
+        status = -EPERM;
+    }
+    else
+    {
+        struct inode *inode_ptr = &fs->inodes[fs->directory[i].inode];
+
+        fs->directory[i].in_use = 0;
+        inode_ptr->in_use = 0;
+        mark_dirty(fs, &fs->directory[i], sizeof(struct directoryEntry));
+        mark_dirty(fs, inode_ptr, sizeof(struct inode));
+        setExtentsUsed(fs, inode_ptr, 0);
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    return status;
+}
+
+/* mfs_undel sets the in_use flags of a deleted file's directory entry and inode back to 1 and claims its
+   blocks again, as long as none of them have been handed to another file since the delete. Blocks that a
+   snapshot or a deduplicated file kept in use just get their reference back.
+*/
+int mfs_undel(mfs_t *fs, const char *name)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+
+    int status = 0;
+    int32_t i = findFile(fs, name, 0);
+    if (i == -1)
+    {
+        status = findFile(fs, name, 1) != -1 ? -EEXIST : -ENOENT;
+    }
+    else if (fs->directory[i].inode == -1)
+    {
+        // a save has made the delete permanent and given the blocks back to the host
+        status = -ESTALE;
+    }
+    else
+    {
+        struct inode *inode_ptr = &fs->inodes[fs->directory[i].inode];
+
+        //the inode or the blocks may have been handed to another file since the delete
+        if (inode_ptr->in_use || !canReclaimExtents(fs, inode_ptr))
+        {
+            status = -ESTALE;
+        }
+        else
+        {
+            fs->directory[i].in_use = 1;
+            inode_ptr->in_use = 1;
+            mark_dirty(fs, &fs->directory[i], sizeof(struct directoryEntry));
+            mark_dirty(fs, inode_ptr, sizeof(struct inode));
+            setExtentsUsed(fs, inode_ptr, 1);
+        }
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    return status;
+}
+
+/* mfs_set_attributes updates the hidden and read only flags of a file. Read only files cannot be deleted.
+   Setting or clearing the compressed flag rewrites the file's data into new blocks.
+*/
+int mfs_set_attributes(mfs_t *fs, const char *name, uint8_t set, uint8_t clear)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+
+    int status = -ENOENT;
+    int32_t i = findFile(fs, name, 1);
+    if (i != -1)
+    {
+        struct directoryEntry *entry = &fs->directory[i];
+        int compressed = fs->inodes[entry->inode].attribute & MFS_ATTR_COMPRESSED;
+
+        status = 0;
+        if ((set & MFS_ATTR_COMPRESSED) && !compressed)
+        {
+            status = compressInode(fs, entry->inode);
+        }
+        else if ((clear & MFS_ATTR_COMPRESSED) && compressed)
+        {
+            status = expandInode(fs, entry->inode);
+        }
+    }
+    if (status == 0)
+    {
+        struct directoryEntry *entry = &fs->directory[i];
+        if (set & MFS_ATTR_HIDDEN)
+        {
+            entry->hidden = 1;
+        }
+        if (set & MFS_ATTR_READONLY)
+        {
+            entry->readOnly = 1;
+        }
+        if (clear & MFS_ATTR_HIDDEN)
+        {
+            entry->hidden = 0;
+        }
+        if (clear & MFS_ATTR_READONLY)
+        {
+            entry->readOnly = 0;
+        }
+        mark_dirty(fs, entry, sizeof(struct directoryEntry));
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    return status;
+}
+
+/* mfs_snapshot records the files of the image under name. The directory, free inode map and inode table
+   are copied into data blocks, along with the indirect blocks of every file, and every data block gains a
+   reference. Taking a snapshot costs a copy of the metadata; file data is only copied once the image changes it.
+*/
+int mfs_snapshot(mfs_t *fs, const char *name)
+{
+    if (strlen(name) > MFS_NAME_MAX)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    pthread_rwlock_wrlock(&fs->lock);
+
+    int status = 0;
+    struct snapshotEntry *snap = NULL;
+    uint8_t *buf = NULL;
+    int32_t i;
+
+    if (!fs->refcounts)
+    {
+        status = -EOPNOTSUPP;
+    }
+    else if (findSnapshot(fs, name))
+    {
+        status = -EEXIST;
+    }
+    else
+    {
+        for (i = 0; i < MAX_SNAPSHOTS && fs->snapshots[i].in_use; i++)
+        {
+        }
+        snap = i < MAX_SNAPSHOTS ? &fs->snapshots[i] : NULL;
+        status = snap ? 0 : -EMLINK;
+    }
+
+    if (status == 0)
+    {
+        int32_t needed = snapshotBlocks(fs);
+        for (i = 0; i < fs->sb->num_files; i++)
+        {
+            if (fs->inodes[i].in_use)
+            {
+                needed += countMapBlocks(fs, &fs->inodes[i]);
+            }
+        }
+
+        buf = malloc((size_t)snapshotBlocks(fs) * fs->sb->block_size);
+        if (!buf)
+        {
+            status = -ENOMEM;
+        }
+        else if (needed > fs->free_block_count)
+        {
+            status = -ENOSPC;
+        }
+        else
+        {
+            status = allocateSnapshot(fs, snap);
+        }
+    }
+
+    if (status == 0)
+    {
+        memcpy(buf, get_block(fs, fs->sb->directory_block), (size_t)snapshotBlocks(fs) * fs->sb->block_size);
+
+        struct inode *inodes = snapshotInodes(fs, buf);
+        for (i = 0; i < fs->sb->num_files; i++)
+        {
+            if (inodes[i].in_use)
+            {
+                copyMapBlocks(fs, &inodes[i]);
+                shareExtents(fs, &fs->inodes[i]);
+            }
+        }
+        moveSnapshot(fs, snap, buf, 1);
+
+        memset(snap->name, 0, 64);
+        strncpy(snap->name, name, MFS_NAME_MAX);
+        snap->in_use = 1;
+        mark_dirty(fs, snap, sizeof(struct snapshotEntry));
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    free(buf);
+    return status;
+}
+
+/* mfs_rollback puts the files of the image back the way they were when snapshot name was taken. The current
+   files give up their blocks, which stay with any snapshot that shares them, and the image takes the snapshot's
+   metadata, its own copy of the indirect blocks and a reference to every data block. The snapshot is kept.
+*/
+int mfs_rollback(mfs_t *fs, const char *name)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+
+    int status = 0;
+    struct snapshotEntry *snap = fs->refcounts ? findSnapshot(fs, name) : NULL;
+    uint8_t *buf = NULL;
+    int32_t i;
+
+    if (!fs->refcounts)
+    {
+        status = -EOPNOTSUPP;
+    }
+    else if (!snap)
+    {
+        status = -ENOENT;
+    }
+    else if (verifySnapshot(fs, snap) < 0)
+    {
+        status = -EIO;
+    }
+    else if (!(buf = malloc((size_t)snapshotBlocks(fs) * fs->sb->block_size)))
+    {
+        status = -ENOMEM;
+    }
+    else
+    {
+        // checked before anything changes; the blocks the current files give up are not counted
+        int32_t needed = 0;
+        struct inode *inodes = snapshotInodes(fs, buf);
+
+        moveSnapshot(fs, snap, buf, 0);
+        for (i = 0; i < fs->sb->num_files; i++)
+        {
+            if (inodes[i].in_use)
+            {
+                needed += countMapBlocks(fs, &inodes[i]);
+            }
+        }
+        status = needed > fs->free_block_count ? -ENOSPC : 0;
+    }
+
+    if (status == 0)
+    {
+        for (i = 0; i < fs->sb->num_files; i++)
+        {
+            if (fs->inodes[i].in_use)
+            {
+                setExtentsUsed(fs, &fs->inodes[i], 0);
+            }
+        }
+
+        memcpy(get_block(fs, fs->sb->directory_block), buf, (size_t)snapshotBlocks(fs) * fs->sb->block_size);
+        mark_dirty(fs, get_block(fs, fs->sb->directory_block), (size_t)snapshotBlocks(fs) * fs->sb->block_size);
+
+        // files deleted before the snapshot was taken may have had their blocks punched out since
+        forgetDeleted(fs);
+
+        for (i = 0; i < fs->sb->num_files; i++)
+        {
+            if (fs->inodes[i].in_use)
+            {
+                copyMapBlocks(fs, &fs->inodes[i]);
+                shareExtents(fs, &fs->inodes[i]);
+            }
+        }
+        rebuildNameIndex(fs);
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    free(buf);
+    return status;
+}
+
+/* mfs_delete_snapshot drops a snapshot, freeing its metadata copy and every block that only it was still using. */
+int mfs_delete_snapshot(mfs_t *fs, const char *name)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+
+    int status = 0;
+    struct snapshotEntry *snap = fs->refcounts ? findSnapshot(fs, name) : NULL;
+    uint8_t *buf = NULL;
+    int32_t i;
+
+    if (!fs->refcounts)
+    {
+        status = -EOPNOTSUPP;
+    }
+    else if (!snap)
+    {
+        status = -ENOENT;
+    }
+    else if (!(buf = malloc((size_t)snapshotBlocks(fs) * fs->sb->block_size)))
+    {
+        status = -ENOMEM;
+    }
+    else
+    {
+        struct inode *inodes = snapshotInodes(fs, buf);
+
+        moveSnapshot(fs, snap, buf, 0);
+        for (i = 0; i < fs->sb->num_files; i++)
+        {
+            if (inodes[i].in_use)
+            {
+                setExtentsUsed(fs, &inodes[i], 0);
+            }
+        }
+        for (i = 0; i < SNAPSHOT_EXTENTS && snap->copy[i].length; i++)
+        {
+            int32_t j;
+            for (j = 0; j < snap->copy[i].length; j++)
+            {
+                releaseBlock(fs, snap->copy[i].start + j);
+            }
+        }
+        memset(snap, 0, sizeof(struct snapshotEntry));
+        mark_dirty(fs, snap, sizeof(struct snapshotEntry));
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    free(buf);
+    return status;
+}
+
+int mfs_list_snapshots(mfs_t *fs, int32_t *cursor, char *name)
+{
+    int found = 0;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    while (fs->snapshots && !found && *cursor < MAX_SNAPSHOTS)
+    {
+        struct snapshotEntry *snap = &fs->snapshots[(*cursor)++];
+        if (snap->in_use)
+        {
+            strncpy(name, snap->name, MFS_NAME_MAX + 1);
+            found = 1;
+        }
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return found;
+}
+
+/* mfs_scrub reads every block in use and checks it against its checksum, spread over one worker thread per
+   core. Damage is then reported by what it hit: the metadata region, snapshot or file holding each bad block.
+   Blocks changed since the last save have no checksum yet and are skipped. */
+int mfs_scrub(mfs_t *fs, mfs_report_fn report, void *arg)
+{
+    struct scrubBatch batch;
+    int status;
+    int32_t i;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    memset(&batch, 0, sizeof(batch));
+    batch.fs = fs;
+
+    if (!fs->checksums)
+    {
+        status = -EOPNOTSUPP;
+    }
+    else if (!(batch.bad = calloc(FREE_MAP_WORDS, sizeof(uint64_t))))
+    {
+        status = -ENOMEM;
+    }
+    else
+    {
+        runWorkers(scrubWorker, &batch, workerCount((fs->sb->num_blocks + SCRUB_BLOCKS - 1) / SCRUB_BLOCKS, 0));
+
+        const struct superblock *sb = fs->sb;
+        const struct { const char *name; int32_t start; } regions[] =
+        {
+            { "superblock", 0 }, { "directory", sb->directory_block }, { "free inode map", sb->free_inode_block },
+            { "inode table", sb->inode_block }, { "free block map", sb->free_map_block },
+            { "reference counts", sb->refcount_block }, { "snapshot table", sb->snapshot_block }, { NULL, sb->checksum_block }
+        };
+        for (i = 0; batch.damaged && regions[i].name; i++)
+        {
+            if (anyBad(batch.bad, regions[i].start, regions[i + 1].start - regions[i].start))
+            {
+                reportFile(report, arg, regions[i].name, -EIO);
+            }
+        }
+        for (i = 0; batch.damaged && i < MAX_SNAPSHOTS; i++)
+        {
+            struct snapshotEntry *snap = &fs->snapshots[i];
+            int j;
+            for (j = 0; snap->in_use && j < SNAPSHOT_EXTENTS && snap->copy[j].length; j++)
+            {
+                if (anyBad(batch.bad, snap->copy[j].start, snap->copy[j].length))
+                {
+                    char label[MFS_NAME_MAX + 16];
+                    snprintf(label, sizeof(label), "snapshot %.63s", snap->name);
+                    reportFile(report, arg, label, -EIO);
+                    break;
+                }
+            }
+        }
+        for (i = 0; batch.damaged && i < fs->sb->num_files; i++)
+        {
+            struct directoryEntry *entry = &fs->directory[i];
+            if (entry->in_use && fileDamaged(fs, &fs->inodes[entry->inode], batch.bad))
+            {
+                reportFile(report, arg, entry->filename, -EIO);
+            }
+        }
+        status = batch.damaged;
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    free(batch.bad);
+    return status;
+}
+
+/*************************************** FILE HANDLE FUNCTIONS ********************************************/
+
+// Helper function that returns 0 if the file behind a handle is still the one it was opened on
+// and -ESTALE if it has been deleted or its slot reused since
+static int checkHandle(mfs_file_t *file)
+{
+    struct directoryEntry *entry = &file->fs->directory[file->entry];
+
+    if (!entry->in_use || entry->inode != file->inode || strncmp(entry->filename, file->name, 64) != 0)
+    {
+        return -ESTALE;
+    }
+    return 0;
+}
+
+// Helper function that creates an empty file called name. Returns its directory slot, or -ENFILE
+// if there is no free slot or inode
+static int32_t createFile(mfs_t *fs, const char *name)
+{
+    int32_t entry_ix = 0;
+    int32_t inode_ix = 0;
+
+    while (entry_ix < fs->sb->num_files && fs->directory[entry_ix].in_use)
+    {
+        entry_ix++;
+    }
+    while (inode_ix < fs->sb->num_files && fs->inodes[inode_ix].in_use)
+    {
+        inode_ix++;
+    }
+    if (entry_ix == fs->sb->num_files || inode_ix == fs->sb->num_files)
+    {
+        return -ENFILE;
+    }
+
+    resetExtents(fs, &fs->inodes[inode_ix]);
+    fillEntry(fs, entry_ix, inode_ix, name, 0);
+    return entry_ix;
+}
+
+/* mfs_open opens a file for reading and writing through a handle. O_CREAT makes an empty file if
+   there is none (O_EXCL makes an existing one an error), O_TRUNC releases all of the file's blocks
+   and O_APPEND makes mfs_write add to the end. Read only files cannot be opened for writing.
+*/
+int mfs_open(mfs_t *fs, const char *name, int flags, mfs_file_t **handle)
+{
+    int writing = (flags & O_ACCMODE) != O_RDONLY;
+    int changes = flags & (O_CREAT | O_TRUNC);
+
+    if (strlen(name) > MFS_NAME_MAX)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    mfs_file_t *file = calloc(1, sizeof(mfs_file_t));
+    if (!file)
+    {
+        return -ENOMEM;
+    }
+
+    if (changes)
+    {
+        pthread_rwlock_wrlock(&fs->lock);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&fs->lock);
+    }
+
+    int status = 0;
+    int32_t i = findFile(fs, name, 1);
+    if (i == -1)
+    {
+        i = flags & O_CREAT ? createFile(fs, name) : -ENOENT;
+        status = i < 0 ? i : 0;
+    }
+    else if ((flags & O_CREAT) && (flags & O_EXCL))
+    {
+        status = -EEXIST;
+    }
+    else if (writing && fs->directory[i].readOnly)
+    {
+        status = -EACCES;
+    }
+    else if (writing && (flags & O_TRUNC))
+    {
+        struct inode *inode_ptr = &fs->inodes[fs->directory[i].inode];
+        truncateExtents(fs, inode_ptr, 0);
+        inode_ptr->file_size = 0;
+        inode_ptr->attribute = 0;
+        mark_dirty(fs, inode_ptr, sizeof(struct inode));
+    }
+
+    if (status == 0)
+    {
+        file->fs    = fs;
+        file->entry = i;
+        file->inode = fs->directory[i].inode;
+        file->flags = flags;
+        strncpy(file->name, name, MFS_NAME_MAX);
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+
+    if (status < 0)
+    {
+        free(file);
+        return status;
+    }
+    *handle = file;
+    return 0;
+}
+
+ssize_t mfs_pread(mfs_file_t *file, void *buf, size_t count, uint64_t offset)
+{
+    mfs_t *fs = file->fs;
+
+    if ((file->flags & O_ACCMODE) == O_WRONLY)
+    {
+        return -EBADF;
+    }
+
+    pthread_rwlock_rdlock(&fs->lock);
+    ssize_t copied = checkHandle(file);
+    if (copied == 0)
+    {
+        copied = readInode(fs, &fs->inodes[file->inode], buf, count, offset);
+    }
+    trimCache(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return copied;
+}
+
+// Helper function that writes into the file behind a handle with the image lock held for writing.
+// Blocks are only allocated once a write reaches them, and the file grows to cover the write.
+static ssize_t writeHandle(mfs_file_t *file, const void *buf, size_t count, uint64_t offset)
+{
+    mfs_t *fs = file->fs;
+    int status = checkHandle(file);
+    if (status < 0)
+    {
+        return status;
+    }
+
+    // file sizes are 32 bits on disk
+    if (offset > UINT32_MAX || count > UINT32_MAX - offset)
+    {
+        return -EFBIG;
+    }
+
+    // like pwrite(2), writing nothing changes nothing, even past the end of the file
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // a compressed file is unpacked for good the first time it is written
+    struct inode *inode_ptr = &fs->inodes[file->inode];
+    if ((inode_ptr->attribute & MFS_ATTR_COMPRESSED) && (status = expandInode(fs, file->inode)) < 0)
+    {
+        return status;
+    }
+
+    // a block the write only partly covers keeps the rest of its bytes, which must be good
+    if (((offset % fs->sb->block_size) && (status = verifyFileBlock(fs, inode_ptr, offset)) < 0) ||
+        (((offset + count) % fs->sb->block_size) && (status = verifyFileBlock(fs, inode_ptr, offset + count)) < 0))
+    {
+        return status;
+    }
+
+    // blocks shared with a snapshot are copied before the write reaches them
+    if ((status = unshareBlocks(fs, inode_ptr, offset / fs->sb->block_size, (offset + count - 1) / fs->sb->block_size)) < 0)
+    {
+        return status;
+    }
+    if ((status = growFile(fs, file->inode, blocksFor(offset + count, fs->sb->block_size))) < 0)
+    {
+        return status;
+    }
+
+    writeInode(fs, inode_ptr, buf, count, offset);
+    addCount(&fs->counters.image_bytes_written, count);
+    if (offset + count > inode_ptr->file_size)
+    {
+        inode_ptr->file_size = offset + count;
+        mark_dirty(fs, inode_ptr, sizeof(struct inode));
+    }
+    return count;
+}
+
+ssize_t mfs_pwrite(mfs_file_t *file, const void *buf, size_t count, uint64_t offset)
+{
+    if ((file->flags & O_ACCMODE) == O_RDONLY)
+    {
+        return -EBADF;
+    }
+
+    pthread_rwlock_wrlock(&file->fs->lock);
+    ssize_t written = writeHandle(file, buf, count, offset);
+    pthread_rwlock_unlock(&file->fs->lock);
+    return written;
+}
+
+ssize_t mfs_read(mfs_file_t *file, void *buf, size_t count)
+{
+    ssize_t copied = mfs_pread(file, buf, count, file->position);
+    if (copied > 0)
+    {
+        file->position += copied;
+    }
+    return copied;
+}
+
+ssize_t mfs_write(mfs_file_t *file, const void *buf, size_t count)
+{
+    if ((file->flags & O_ACCMODE) == O_RDONLY)
+    {
+        return -EBADF;
+    }
+
+    // with O_APPEND the end of the file is looked up under the same lock as the write
+    pthread_rwlock_wrlock(&file->fs->lock);
+    if ((file->flags & O_APPEND) && checkHandle(file) == 0)
+    {
+        file->position = file->fs->inodes[file->inode].file_size;
+    }
+    ssize_t written = writeHandle(file, buf, count, file->position);
+    if (written > 0)
+    {
+        file->position += written;
+    }
+    pthread_rwlock_unlock(&file->fs->lock);
+    return written;
+}
+
+int64_t mfs_lseek(mfs_file_t *file, int64_t offset, int whence)
+{
+    int64_t base;
+
+    if (whence == SEEK_SET)
+    {
+        base = 0;
+    }
+    else if (whence == SEEK_CUR)
+    {
+        base = file->position;
+    }
+    else if (whence == SEEK_END)
+    {
+        pthread_rwlock_rdlock(&file->fs->lock);
+        int status = checkHandle(file);
+        base = file->fs->inodes[file->inode].file_size;
+        pthread_rwlock_unlock(&file->fs->lock);
+        if (status < 0)
+        {
+            return status;
+        }
+    }
+    else
+    {
+        return -EINVAL;
+    }
+
+    if (base + offset < 0)
+    {
+        return -EINVAL;
+    }
+    file->position = base + offset;
+    return file->position;
+}
+
+int mfs_close(mfs_file_t *file)
+{
+    free(file);
+    return 0;
+}
+
+const char *mfs_strerror(int status)
+{
+    switch (-status)
+    {
+        case 0:      return "Success";
+        case ERANGE: return "Image is too small for its metadata";
+        case ENFILE: return "No available directory entry";
+        case EMLINK: return "Too many snapshots";
+        case EOPNOTSUPP: return "Image was made without snapshot support";
+        default:     return strerror(-status);
+    }
+}
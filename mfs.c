@@ -1,7 +1,7 @@
 /***********************************
 HOW TO COMPILE mfs.c:
 
-gcc -g -Wall -Werror --std=c99 mfs.c
+gcc -g -Wall -Werror --std=c99 mfs.c libmfs.c -pthread
 ************************************/
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -12,45 +12,42 @@ gcc -g -Wall -Werror --std=c99 mfs.c
 #include <string.h>
 #include <signal.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <time.h>
 
-#define BLOCK_SIZE 1024
-#define NUM_BLOCKS 65536
-#define BLOCKS_PER_FILE 1024
-#define NUM_FILES 256
-#define FIRST_DATA_BLOCK 790 
-#define MAX_FILE_SIZE 1048576
+#include "mfs.h"
 
-uint8_t data[NUM_BLOCKS][BLOCK_SIZE];
-uint8_t *free_blocks; 
-uint8_t *free_inodes;
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_IMAGE_SIZE (64 * 1024 * 1024)
+#define HEX_BUFFER_BYTES 4096         // bytes formatted per fwrite by read
+#define LATENCY_BUCKETS 32            // bucket b counts commands that took under 2^b microseconds, and at least 2^(b-1)
 
-//directory structure
-struct directoryEntry
-{
-    char    filename[64];
-    short   in_use;
-    int32_t inode;
-    uint8_t hidden;
-    uint8_t readOnly;
-};
+// the open image, or NULL when there is none
+mfs_t  *fs;
+char 	image_name[64];
+uint8_t is_saved;
 
-struct directoryEntry *directory;
+// "00 " through "ff ", filled in by init so read can format a byte with a single copy
+char hex_pairs[256][3];
 
-//inode structure
-struct inode
+// how long each command has taken since mfs started, for the stats command. Anything that is not
+// a command counts as "other".
+struct commandStats
 {
-    int32_t  blocks[BLOCKS_PER_FILE];
-    short    in_use;
-	uint8_t  attribute;
-	uint32_t file_size;
+    uint64_t runs;
+    uint64_t failures;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
 };
 
-struct inode *inodes;
+const char *command_names[] = { "createfs", "open", "close", "savefs", "list", "df", "insert", "retrieve",
+                                "extract-all", "read", "delete", "undel", "attrib", "snapshot", "rollback",
+                                "scrub", "cache", "stats", "quit", "other" };
+#define NUM_COMMANDS (int)(sizeof(command_names) / sizeof(command_names[0]))
 
-FILE 	*fp;
-char 	image_name[64];
-uint8_t image_open;
-uint8_t is_saved;
+struct commandStats command_stats[NUM_COMMANDS];
 
 #define WHITESPACE " \t\n"      // We want to split our command line up into tokens
                                 // so we need to define what delimits our tokens.
@@ -59,111 +56,46 @@ uint8_t is_saved;
 
 #define MAX_COMMAND_SIZE 255    // The maximum command-line size
 
-#define MAX_NUM_ARGUMENTS 5     // Mav shell only supports four arguments
+#define MAX_NUM_ARGUMENTS 9     // Mav shell only supports eight arguments
 
 
 /*************************************** FILE COMMAND FUNCTIONS ********************************************/
 
-// Helper function that returns the index of a free block on success and -1 on failure
-int32_t findFreeBlock()
-{
-	int i;
-	for(i = 0; i < NUM_BLOCKS; i++)
-	{
-		if(free_blocks[i])
-		{
-			return i + FIRST_DATA_BLOCK;
-		}
-	}
-	return -1;
-}
-
-// Helper function that returns the index of a free inode on success and -1 on failure
-int32_t findFreeInode()
-{
-	int i;
-
-	for(i = 0; i < NUM_FILES; i++)
-	{
-		if(free_inodes[i])
-		{
-			return i;
-		}
-	}
-	return -1;
-}
-
-// Helper function that returns a free inode block on success and -1 on failure
-int32_t findFreeInodeBlock(int32_t inode)
-{
-	int i;
-
-	for(i = 0; i < BLOCKS_PER_FILE; i++)
-	{
-		if(inodes[inode].blocks[i] == -1)
-		{
-			return i;
-		}
-	}
-
-	return -1;
-}
+// Each command calls into libmfs, prints its own messages and returns 0 on success or -1 on
+// failure, so batch mode can stop at the first command that goes wrong.
 
 /* 
    The delete function takes a filename, searches the global directory, and if the file is found, sets its directory/inode 
    in_use flags to 0, effectively deleting it from our disk image. Deletes the file from the filesystem image, If the file 
    does exist in the file system it shall be deleted and all the space available for additional files.
 */
-void delete(char *filename)
+int delete(char *filename)
 {
-    //declares the delete function and specifies that it takes a char * argument called filename.
-    is_saved = 0;
     //This line sets the global is_saved flag to 0, 
     //indicating that the disk image is not in a saved state after the file deletion
-    if (image_open == 0)
+    is_saved = 0;
+    if (fs == NULL)
     {
         printf("ERROR: Disk image is not open\n");
-        return;
+        return -1;
     }
 
-    int found = 0;
-    int i;
-    for (i = 0; i < NUM_FILES; i++)
+    int status = mfs_delete(fs, filename);
+    if (status == -ENOENT)
     {
-        if (directory[i].in_use && strcmp(directory[i].filename, filename) == 0)
-        {
-            //If the file is marked as readOnly, it prints an error message 
-            //and returns without performing any deletion.
-            if(directory[i].readOnly)
-            {
-                printf("ERROR: File is read only -- cannot delete\n");
-                return;
-            }
-
-            //sets the in_use flag of the directory and inode entries to 0, 
-            //indicating that they are no longer being used.
-            found = 1;
-            directory[i].in_use = 0;
-            inodes[directory[i].inode].in_use = 0;            
-
-            int j;
-            for(j = inodes[directory[i].inode].blocks[0]; j < BLOCKS_PER_FILE; j++)
-            {
-                //marks all the blocks corresponding to the file 
-                //as free by setting the free_blocks array elements to 1.
-                free_blocks[j] = 1;
-            }
-            break;
-        }
+        printf("ERROR: File not found\n");
+        return -1;
     }
 
-    if (!found)
+    //If the file is marked as readOnly, nothing is deleted
+    if (status == -EPERM)
     {
-        printf("ERROR: File not found\n");
-        return;
+        printf("ERROR: File is read only -- cannot delete\n");
+        return -1;
     }
 
     printf("File %s deleted successfully\n", filename);
+    return 0;
 }
 
 /* The undel function takes a filename, searches the global directory, and if the file is found, 
@@ -171,133 +103,136 @@ void delete(char *filename)
    Undeletes the file from the filesystem imageThe undelete command allows the user to undelete
    a file that has been deleted from the file system .
 */
-void undel(char *filename)
+int undel(char *filename)
 {
     //sets the global is_saved flag to 0, indicating that the disk image is 
     //not in a saved state after the file undeletion.
     is_saved = 0;
-    if (image_open == 0)
+    if (fs == NULL)
     {
         printf("ERROR: Disk image is not open\n");
-        return;
+        return -1;
     }
 
-    //checks if the global image_open flag is 0, indicating that the disk image is not currently open. 
-    //if so, it prints an error message and returns without performing any undeletion.
-    int file_found = 0;
-    int i;
-    for (i = 0; i < NUM_FILES; i++)
+    int status = mfs_undel(fs, filename);
+    if (status == -EEXIST)
     {
-        //sets the file_found flag to 1, indicating that the file was found and can be undeleted.
-        if (!directory[i].in_use && strcmp(directory[i].filename, filename) == 0)
-        {
-            file_found = 1;
-
-            if (inodes[directory[i].inode].in_use == 0)
-            {
-                directory[i].in_use = 1;
-                inodes[directory[i].inode].in_use = 1;
-                printf("File %s has been undeleted\n", filename);
+        printf("File %s has not been deleted\n", filename);
+        return -1;
+    }
+    if (status == -ENOENT)
+    {
+        printf("File not found in the directory\n");
+        return -1;
+    }
 
-                int j;
-                for(j = inodes[directory[i].inode].blocks[0]; j < BLOCKS_PER_FILE; j++)
-                {
-                    free_blocks[j] = 0;
-                }
+    //the inode or the blocks may have been handed to another file, or back to the host by a save, since the delete
+    if (status == -ESTALE)
+    {
+        printf("File %s can no longer be recovered\n", filename);
+        return -1;
+    }
 
-            }
-            //if inode is already in use, it prints a message indicating that the file has not been deleted.
-            else
-            {
-                printf("File %s has not been deleted\n", filename);
-            }
+    printf("File %s has been undeleted\n", filename);
+    return 0;
+}
 
-            break;
-        }
-    }
+// Helper function that prints len bytes to stdout as space separated hex pairs. The bytes are
+// formatted through hex_pairs into a buffer that goes out with a single fwrite each time it fills.
+void writeHex(const uint8_t *buf, size_t len)
+{
+    char   out[HEX_BUFFER_BYTES * 3];
+    size_t i;
 
-    //if the filename is not found in the directory.
-    if (!file_found)
+    while (len > 0)
     {
-        printf("File not found in the directory\n");
+        size_t chunk = len < HEX_BUFFER_BYTES ? len : HEX_BUFFER_BYTES;
+        char  *pos = out;
+        for (i = 0; i < chunk; i++)
+        {
+            memcpy(pos, hex_pairs[buf[i]], 3);
+            pos += 3;
+        }
+        fwrite(out, 3, chunk, stdout);
+        buf += chunk;
+        len -= chunk;
     }
-
 }
 
 /* The read function takes in a filename, a starting byte and a total number of bytes and prints to stdout the number
    of bytes specified from the file in hex. Print <number of bytes>
-   bytes from the file, in hexadecimal, starting at <starting byte> 
+   bytes from the file, in hexadecimal, starting at <starting byte>. If binary is set the bytes are written to stdout
+   as they are instead.
 */
-void read_file(char *filename, int starting_byte, int number_of_bytes)
+int read_file(char *filename, int starting_byte, int number_of_bytes, int binary)
 {
-    if (image_open == 0)
+    if (fs == NULL)
     {
         printf("ERROR: Disk image is not open\n");
-        return;
+        return -1;
     }
 
-    ////searches for the filename in the directory array by iterating over all the entries in the array,.
-    //checks if the global image_open flag is 0, indicating that the disk image is not currently open. 
-    //if so, it prints an error message and returns without performing any read operation.
-    int found = 0;
-    int i;
-    for (i = 0; i < NUM_FILES; i++)
-    {
-        //if the filename is found and its corresponding directory entry is marked as in_use, the function
-        //sets the found flag to 1 and exits the loop.
-        if (directory[i].in_use && strcmp(directory[i].filename, filename) == 0)
-        {
-            found = 1;
-            break;
-        }
-    }
-
-    //if the filename is not found,the function 
+    //looks the filename up. If the filename is not found,the function 
     //prints an error message and returns without performing any read operation.
-    if (!found)
+    struct mfs_stat st;
+    if (mfs_stat(fs, filename, &st) < 0)
     {
         printf("ERROR: File not found\n");
-        return;
+        return -1;
     }
-    
-    //retrieves a pointer to the inode entry corresponding to the file in the directory array.
-    struct inode *inode_ptr = &inodes[directory[i].inode];
 
     //checks if the starting_byte is within the valid range of 0 to the size of the file in bytes. 
     //if not, it prints an error message and returns without performing any read operation.
-    if (starting_byte < 0 || starting_byte >= BLOCK_SIZE * BLOCKS_PER_FILE)
+    if (starting_byte < 0 || (uint32_t)starting_byte >= st.size)
     {
         printf("ERROR: Invalid starting byte\n");
-        return;
+        return -1;
     }
 
     //checks if the number_of_bytes is within the valid range of 1 to the remaining bytes in the file starting from the starting_byte offset. 
     //if not, it prints an error message and returns without performing any read operation.
-    if (number_of_bytes <= 0 || number_of_bytes > BLOCK_SIZE * BLOCKS_PER_FILE - starting_byte)
+    if (number_of_bytes <= 0 || (uint32_t)number_of_bytes > st.size - starting_byte)
     {
         printf("ERROR: Invalid number of bytes\n");
-        return;
+        return -1;
     }
 
-    //sets up the necessary variables to read the specified bytes from the file:
-    int block_index = starting_byte / BLOCK_SIZE;
-    int block_offset = starting_byte % BLOCK_SIZE;
-    int bytes_remaining = number_of_bytes;
+    //copies the range out a buffer at a time and emits each buffer in one go
+    uint8_t buf[HEX_BUFFER_BYTES * 16];
+    size_t  position = starting_byte;
+    size_t  bytes_remaining = number_of_bytes;
 
     while (bytes_remaining > 0)
     {
-        int bytes_to_read = (BLOCK_SIZE - block_offset < bytes_remaining) ? BLOCK_SIZE - block_offset : bytes_remaining;
+        ssize_t got = mfs_read_file(fs, filename, buf, bytes_remaining < sizeof(buf) ? bytes_remaining : sizeof(buf), position);
+        if (got < 0)
+        {
+            printf("\nERROR: Could not read %s: %s\n", filename, mfs_strerror(got));
+            return -1;
+        }
+        if (got == 0)
+        {
+            break;
+        }
 
-        for (i = 0; i < bytes_to_read; i++)
+        if (binary)
         {
-            printf("%02x ", data[inode_ptr->blocks[block_index]][block_offset + i]);
+            fwrite(buf, 1, got, stdout);
         }
+        else
+        {
+            writeHex(buf, got);
+        }
+        position += got;
+        bytes_remaining -= got;
+    }
 
-        bytes_remaining -= bytes_to_read;
-        block_index++;
-        block_offset = 0;
+    if (!binary)
+    {
+        printf("\n");
     }
-    printf("\n");
+    fflush(stdout);
+    return 0;
 }
 
 /* The list function simply lists the files in the directory of the current open disk image.
@@ -308,9 +243,8 @@ void read_file(char *filename, int starting_byte, int number_of_bytes)
    list command shall display all the files in the file system,their size in bytes and the time they were added to the file system
    this function takes two character pointers "flag1" and "flag2" as parameters. The function lists the files in a directory along with their attributes (if specified by the flags).
 */
-void list(char *flag1, char *flag2)
+int list(char *flag1, char *flag2)
 {
-    int i;
     int not_found = 1;
     int show_hidden = 0;
     int show_attrib = 0;
@@ -338,7 +272,7 @@ void list(char *flag1, char *flag2)
         if(no_match)
         {
             printf("ERROR: Invalid list flag. Must be -h or -a\n");
-            return;
+            return -1;
         }
     }
 
@@ -362,41 +296,36 @@ void list(char *flag1, char *flag2)
         if(no_match)
         {
             printf("ERROR: Invalid list flag. Must be -h or -a\n");
-            return;
+            return -1;
         }
     }
 
-    for(i = 0; i < NUM_FILES; i++)
+    int32_t cursor = 0;
+    struct mfs_stat st;
+    while(mfs_readdir(fs, &cursor, &st))
     {
-        if(directory[i].in_use)
+        if( show_hidden || !(st.attributes & MFS_ATTR_HIDDEN))
         {
+            not_found = 0;
+            printf("%s", st.name);
 
-            if( show_hidden || !directory[i].hidden)
+            if(show_attrib)
             {
-                if(not_found == 1)
+                if(st.attributes & MFS_ATTR_HIDDEN)
                 {
-                    not_found = 0;
+                    printf(" [h]");
                 }
-
-                char filename[65];
-                memset(filename, 0, 65);
-                strncpy(filename, directory[i].filename, strlen(directory[i].filename));
-                printf("%s", filename);
-
-                if(show_attrib)
+                if(st.attributes & MFS_ATTR_READONLY)
                 {
-                    if(directory[i].hidden)
-                    {
-                        printf(" [h]");
-                    }
-                    if(directory[i].readOnly)
-                    {
-                        printf(" [r]");
-                    }
+                    printf(" [r]");
                 }
+                if(st.attributes & MFS_ATTR_COMPRESSED)
+                {
+                    printf(" [c]");
+                }
+            }
 
-                printf("\n");
-            }  
+            printf("\n");
         }
     }
 
@@ -404,543 +333,701 @@ void list(char *flag1, char *flag2)
     {
         printf("Directory is empty\n");
     }
+
+    return 0;
 }
 
-/* file_insert function takes a file from the current working directory 
-   //and inserts it into the currently open disk image. 
-   command insert allows the user to put a new file into the file system
-*/
-void file_insert(char *src_filename)
+// Prints the outcome of inserting one file
+void reportInsert(void *arg, const char *name, int status)
 {
-    is_saved = 0;
-    if (image_open == 0)
+    switch (-status)
     {
-        printf("ERROR: Disk image is not open\n");
-        return;
-    }
-
-    //If there is not enough disk space for the file an error will be returned
-    if (strlen(src_filename) > 63)
-    {
-        printf("insert error: File name too long.\n");
-        return;
-    }
-
-    int directory_index = -1;
-    int inode_ix = -1;
-    int i;
-    for (i = 0; i < NUM_FILES; i++)
-    {
-        if (!directory[i].in_use)
-        {
-            if (directory_index == -1)
-                directory_index = i;
-        }
-        if (!inodes[i].in_use)
-        {
-            if (inode_ix == -1)
-                inode_ix = i;
-        }
-        if (directory_index != -1 && inode_ix != -1)
-            break;
-    }
-
-    if (directory_index == -1)
-    {
-        printf("ERROR: No available directory entry\n");
-        return;
-    }
-
-    if (inode_ix == -1)
-    {
-        printf("ERROR: No available inode\n");
-        return;
+        case 0:            printf("File %s inserted successfully\n", name); break;
+        case ENOENT:       printf("ERROR: Cannot open source file %s\n", name); break;
+        case EISDIR:       printf("insert error: %s is a directory, use insert -r\n", name); break;
+        case EINVAL:       printf("insert error: %s is not a regular file.\n", name); break;
+        case ENAMETOOLONG: printf("insert error: File name too long: %s\n", name); break;
+        case EFBIG:        printf("insert error: File %s too large.\n", name); break;
+        case EEXIST:       printf("insert error: File %s already exists.\n", name); break;
+        default:           printf("insert error: Could not read %s: %s\n", name, mfs_strerror(status)); break;
     }
+}
 
-    FILE *src_file = fopen(src_filename, "rb");
-    if (!src_file)
+/* file_insert function takes files from the current working directory 
+   //and inserts them into the currently open disk image. 
+   command insert allows the user to put new files into the file system. Each name may be a
+   glob pattern. flags are MFS_INSERT_RECURSIVE to insert directories with everything under them,
+   MFS_INSERT_DEDUP to share blocks whose contents are already in the image and MFS_INSERT_COMPRESS
+   to store the files compressed.
+*/
+int file_insert(char **src_filenames, int count, int flags)
+{
+    is_saved = 0;
+    if (fs == NULL)
     {
-        printf("ERROR: Cannot open source file\n");
-        return;
+        printf("ERROR: Disk image is not open\n");
+        return -1;
     }
 
-    fseek(src_file, 0, SEEK_END);
-    long file_size = ftell(src_file);
-    fseek(src_file, 0, SEEK_SET);
-
-    int required_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-    int free_count_block = 0;
-    for (i = FIRST_DATA_BLOCK; i < NUM_BLOCKS; i++)
-    {
-        if (free_blocks[i])
-            free_count_block++;
-    }
+    int status = mfs_insert(fs, src_filenames, count, flags, reportInsert, NULL);
 
-    if (free_count_block < required_blocks)
+    //these two stop the whole batch before any file is reported
+    if (status == -ENOSPC)
     {
         printf("insert error: Not enough disk space.\n");
-        fclose(src_file);
-        return;
     }
-
-    strncpy(directory[directory_index].filename, src_filename, 64);
-    directory[directory_index].inode = inode_ix;
-    directory[directory_index].in_use = 1;
-    directory[directory_index].readOnly = 0;
-    directory[directory_index].hidden = 0;
-
-    inodes[inode_ix].in_use = 1;
-
-    int block_index = 0;
-    for (i = FIRST_DATA_BLOCK; i < NUM_BLOCKS && block_index < required_blocks; i++)
+    else if (status == -ENFILE)
     {
-        if (free_blocks[i])
-        {
-            fread(data[i], 1, BLOCK_SIZE, src_file);
-            inodes[inode_ix].blocks[block_index++] = i;
-            free_blocks[i] = 0;
-        }
+        printf("ERROR: No available directory entry\n");
     }
-
-    fclose(src_file);
-
-    printf("File %s inserted successfully\n", src_filename);
+    return status < 0 ? -1 : 0;
 }
 
 /* The init function is setup code that runs at the beginning of the program's life. It initializes our data structures
-   to the appropriate values.*/
+   to the appropriate values. No image is open yet, so fs stays NULL until createfs or openfs.*/
 void init()
 {
     is_saved = 0;
-
-	directory = (struct directoryEntry*)&data[0][0];
-	inodes 	  = (struct inode*)&data[20][0];
-	free_blocks = (uint8_t *)&data[277][0];
-	free_inodes = (uint8_t *)&data[19][0];
-
+	fs       = NULL;
 	memset( image_name, 0, 64);
-	image_open = 0;
 
 	int i;
-	for(i = 0; i < NUM_FILES; i++)
+	for(i = 0; i < 256; i++)
 	{
-		directory[i].in_use = 0;
-		directory[i].inode  = -1;
-		free_inodes[i] 		= 1;
-
-		memset(directory[i].filename, 0, 64);
-
-		int j;
-		for(j = 0; j < NUM_BLOCKS; j++)
-		{
-			inodes[i].blocks[j] = -1;
-			inodes[i].in_use 	= 0;
-			inodes[i].attribute = 0;
-			inodes[i].file_size = 0;
-		}
-	}
-	int j;
-	for(j = 0; j < NUM_BLOCKS; j++)
-	{
-		free_blocks[j] = 1;
-	}
-
-}
-
-/* 
-   df command displays the amount of free space in the file system in bytes.
-   the df function lists the amount of available disk space for the currently open disk image by iterating 
-   through the number of free blocks and multiplying each one by the BLOCK_SIZE. 
-    df() returns the amount of free disk space in the virtual file system contained within a disk image, 
-    measured in bytes. The function iterates over all data blocks in the virtual file system and counts the 
-    number of free blocks.It then multiplies the count by the block size to calculate the total amount of free space in bytes. 
-    */
-uint32_t df()
-{
-	int i;
-	int count = 0;
-
-	for(i = FIRST_DATA_BLOCK; i < NUM_BLOCKS; i++)
-	{	
-		if(free_blocks[i])
-		{
-			count++;
-		}
+		hex_pairs[i][0] = "0123456789abcdef"[i >> 4];
+		hex_pairs[i][1] = "0123456789abcdef"[i & 15];
+		hex_pairs[i][2] = ' ';
 	}
-	count = count * BLOCK_SIZE;
-	return count;
 }
 
 /* creates a file system image file with the named provided by the user. 
-   The createfs function creates a new disk image and initializes its structures to the appropriate values. No changes made to 
-   the disk image will be saved unless save is specifically called by the user. 
+   The createfs function creates a new disk image of image_size bytes made of block_size byte blocks with room for
+   num_files files (0 picks one file per 16 blocks) and opens it in place of the current image.
 */
-void createfs(char *filename)
+int createfs(char *filename, size_t image_size, int32_t block_size, int32_t num_files)
 {
-    // first opens the file in write mode and saves the filename to a global variable. The function then initializes 
-    //all data blocks to 0 and sets the image_open flag to 1, indicating that a disk image is open.
-    is_saved = 0;
-	fp = fopen(filename, "w");
-	strncpy(image_name, filename, strlen(filename));
-	memset( data, 0, NUM_BLOCKS * BLOCK_SIZE);
-	image_open = 1;
+    mfs_t *created;
+    int    status = mfs_createfs(&created, filename, image_size, block_size, num_files);
 
-    //All inode blocks are also set to -1, indicating that they are not being used.
-	int i;
-	for(i = 0; i < NUM_FILES; i++)
-	{
-		directory[i].in_use     = 0;
-		directory[i].inode      = -1;
-        directory[i].hidden     = 0;
-        directory[i].readOnly   = 0;
-		free_inodes[i] 		    = 1;
-
-		memset(directory[i].filename, 0, 64);
+    if(status == -EINVAL)
+    {
+        printf("createfs: Block size must be a power of two between %d and %d\n", MFS_MIN_BLOCK_SIZE, MFS_MAX_BLOCK_SIZE);
+        return -1;
+    }
+    if(status == -ERANGE)
+    {
+        printf("createfs: Image is too small for that many files\n");
+        return -1;
+    }
+    if(status < 0)
+    {
+        printf("createfs: Could not create %s: %s\n", filename, mfs_strerror(status));
+        return -1;
+    }
 
-		int j;
-		for(j = 0; j < NUM_BLOCKS; j++)
-		{
-			inodes[i].blocks[j] = -1;
-			inodes[i].in_use 	= 0;
-			inodes[i].attribute = 0;
-			inodes[i].file_size = 0;
-		}
-	}
+    // the new image replaces whatever was open, discarding its unsaved changes
+    is_saved = 0;
+    mfs_closefs(fs);
+    fs = created;
 
-    // sets all data blocks to be free by setting the corresponding flags in the free_blocks array. This function creates a blank virtual file system in the disk image, 
-    // ready to have files inserted into it using other functions.
-	int j;
-	for(j = 0; j < NUM_BLOCKS; j++)
-	{
-		free_blocks[j] = 1;
-	}
+	memset(image_name, 0, 64);
+	strncpy(image_name, filename, 63);
+	return 0;
 }
 
 /* savefs command writes the file system to disk.
    The savefs function saves the currently open disk image. This includes any inserts, deletes, 
-   undeletes, attributes, etc. 
+   undeletes, attributes, etc. Only the blocks modified since the last save are written.
 */
-void savefs()
+int savefs()
 {
     is_saved = 1;
 
-	if(image_open == 0)
+	if(fs == NULL)
 	{
 		printf("Error: Disk image is not open\n");
+		return -1;
 	}
 
     //indicates that the current state of the virtual file system has been saved to the disk image file. 
     //This function is used to save changes made to the virtual file system so that they can be loaded and used in the future.
 	else
 	{
-		fp = fopen( image_name, "w");
-
-		fwrite( &data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
-
-		memset(image_name, 0, 64);
+		int status = mfs_savefs(fs);
+		if(status == -ENOSPC)
+		{
+			printf("ERROR: Could not save %s: too much of the space freed since the last save has been reused.\n"
+			       "Delete the newest files, save, and then add them again.\n", image_name);
+			is_saved = 0;
+		}
+		else if(status < 0)
+		{
+			printf("ERROR: Could not save %s\n", image_name);
+			is_saved = 0;
+		}
 	}
+
+	return is_saved ? 0 : -1;
 }
 
 /* open command opens a file system image file with the name and path given by the user.
-   The openfs function will open the specified disk image. Changes will not be saved unless savefs is 
-   called 
+   The openfs function maps the specified disk image in place of the current one.
 */
-void openfs(char *filename)
+int openfs(char *filename)
 {
     is_saved = 0;
+    mfs_closefs(fs);
+    fs = NULL;
 
-	fp = fopen( filename, "r");
-
-	strncpy(image_name, filename, strlen( filename));
-
-	fread(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
+	int status = mfs_openfs(&fs, filename);
+	if(status == -ENOENT)
+	{
+		printf("open: File not found\n");
+		return -1;
+	}
+	if(status == -EIO)
+	{
+		printf("open: %s is damaged, its metadata does not match the checksums\n", filename);
+		return -1;
+	}
+	if(status < 0)
+	{
+		printf("open: %s is not a valid disk image\n", filename);
+		return -1;
+	}
 
-	image_open = 1;
+	memset(image_name, 0, 64);
+	strncpy(image_name, filename, 63);
+	return 0;
 }
 
 /* close command closes a file system image file with the name and path given by the user. 
-   The close function simply closes the global file pointer. The user is required to close any open files 
+   The close function releases the image, discarding any unsaved changes. The user is required to close any open files 
    before exiting to prevent data corruption. 
 */
-void closefs()
+int closefs()
 {
     //changes have been made to the disk image file that have not been saved, it sets is_saved to true.
     is_saved = 1;
     //indicates that no disk image file is currently open
-	if(image_open == 0)
+	if(fs == NULL)
 	{
 		printf("close: File not open\n");
-		return;
+		return -1;
 	}
-	fclose( fp );
+	mfs_closefs(fs);
+	fs = NULL;
 
 	memset(image_name, 0, 64);
-	image_open = 0;
+	return 0;
 }
 
 /* attrib command sets or removes an attribute from the file. 
    The attrib function can update the attribute flags of a file. Namely, +r and +h will make the file read only or hidden respectively.
    Specifying -r or -h will remove the associated attributes from the file. Read only files cannot be deleted. 
+   +c stores the file compressed and -c stores it plainly again.
 */
-void attrib(char *filename, char *attribute)
+int attrib(char *filename, char *attribute)
 {
-    uint8_t hidden_plus_flag = 0;
-    uint8_t hidden_minus_flag = 0;
-
-    uint8_t readOnly_plus_flag = 0;
-    uint8_t readOnly_minus_flag = 0;
+    uint8_t set = 0;
+    uint8_t clear = 0;
+    const char *message;
 
     //checks if the attribute provided is valid and sets the appropriate flag accordingly. 
     //if the attribute provided is not valid, it prints an error message and returns.
-    //error checking and Setting the attribute flags
     if( strcmp(attribute,"+h") == 0)
     {
-        hidden_plus_flag = 1;
+        set = MFS_ATTR_HIDDEN;
+        message = "Adding the \"h\" attribute to";
     }
     else if( strcmp(attribute, "-h") == 0)
     {
-        hidden_minus_flag = 1;
+        clear = MFS_ATTR_HIDDEN;
+        message = "Removing the \"h\" attribute from";
     }
     else if( strcmp(attribute, "-r") == 0)
     {
-        readOnly_minus_flag = 1;
+        clear = MFS_ATTR_READONLY;
+        message = "Removing the \"r\" attribute from";
     }
     else if( strcmp(attribute, "+r") == 0)
     {
-        readOnly_plus_flag = 1;
+        set = MFS_ATTR_READONLY;
+        message = "Adding the \"r\" attribute to";
+    }
+    else if( strcmp(attribute, "+c") == 0)
+    {
+        set = MFS_ATTR_COMPRESSED;
+        message = "Adding the \"c\" attribute to";
+    }
+    else if( strcmp(attribute, "-c") == 0)
+    {
+        clear = MFS_ATTR_COMPRESSED;
+        message = "Removing the \"c\" attribute from";
     }
     else
     {
-        printf("USAGE ERROR: attrib [+attribute] [-attribute] <filename>\nAttributes: h (hidden), r (read only)\n");
-        return;
+        printf("USAGE ERROR: attrib [+attribute] [-attribute] <filename>\nAttributes: h (hidden), r (read only), c (compressed)\n");
+        return -1;
+    }
+
+    if(fs == NULL)
+    {
+        printf("ERROR: Disk image is not open\n");
+        return -1;
     }
 
-    //searches for the file with the given filename and sets the attribute based on the flag that was set earlier. 
     //if the file is not found, it prints an error message and returns.
-    // Finding the file and setting its attributes accordingly
-    int i;
-    for(i = 0; i < NUM_FILES; i++)
+    int status = mfs_set_attributes(fs, filename, set, clear);
+    if(status == -ENOENT)
     {
-        //if attribute is successfully set, the function prints a message indicating whether the attribute was added or removed. Finally, it sets the is_saved flag to 0, 
-        //indicating that changes have been made to the file system and need to be saved
-        if(directory[i].in_use && strcmp(directory[i].filename, filename) == 0)
-        {
-            //found the file requested
-            if(hidden_plus_flag)
-            {
-                directory[i].hidden = 1;
-                printf("Adding the \"h\" attribute to %s\n", filename);
-            }
-            else if(hidden_minus_flag)
-            {
-                directory[i].hidden = 0;
-                printf("Removing the \"h\" attribute from %s\n", filename);
-            }
-            else if(readOnly_minus_flag)
-            {
-                directory[i].readOnly = 0;
-                printf("Removing the \"r\" attribute from %s\n", filename);
-            }
-            else if(readOnly_plus_flag)
-            {
-                directory[i].readOnly = 1;
-                printf("Adding the \"r\" attribute to %s\n", filename);
-            }
-            else
-            {
-                printf("ERROR: Something went wrong while setting the attributes\n");
-                return;
-            }
-            
-            // leaving the for loop once we've found what we're looking for
-            break;
-        }
-        else
-        {
-            printf("attrib: File %s not found\n", filename);
-            return;
-        }
+        printf("attrib: File %s not found\n", filename);
+        return -1;
     }
+    if(status < 0)
+    {
+        printf("attrib: Could not change %s: %s\n", filename, mfs_strerror(status));
+        return -1;
+    }
+    printf("%s %s\n", message, filename);
+
+    //indicating that changes have been made to the file system and need to be saved
     is_saved = 0;
+    return 0;
 }
 
 /* The retrieve function takes a file from the disk image and places it in the current working directory. If
     an additional file has been specified, it will create a new copy of the source file and place it into the
     current working directory. */
-void retrieve(char *src_filename, char *new_filename)
+int retrieve(char *src_filename, char *new_filename)
 {
-    if (image_open == 0)
+    if (fs == NULL)
     {
         printf("ERROR: Disk image is not open\n");
-        return;
+        return -1;
     }
 
-    int found = 0;
-    int i;
-    for (i = 0; i < NUM_FILES; i++)
+    struct mfs_stat st;
+    if (mfs_stat(fs, src_filename, &st) < 0)
     {
-        if (directory[i].in_use && strcmp(directory[i].filename, src_filename) == 0)
-        {
-            found = 1;
-            break;
-        }
+        printf("ERROR: File not found\n");
+        return -1;
     }
 
-    if (!found)
+    // Determining which version of retrieve to use
+    int status = mfs_retrieve(fs, src_filename, new_filename ? new_filename : src_filename);
+    // damaged blocks and a failed write both come back as -EIO
+    if (status == -EIO)
     {
-        printf("ERROR: File not found\n");
-        return;
+        printf("ERROR: Could not copy %s out to the output file\n", src_filename);
+        return -1;
+    }
+    if (status < 0)
+    {
+        printf("ERROR: Could not create output file\n");
+        return -1;
     }
+    return 0;
+}
 
-    int status;
-    struct stat buf;
+// Prints the failures of an extract-all and counts the files that made it out and the ones that didn't
+void reportExtract(void *arg, const char *name, int status)
+{
+    int *counts = arg;
 
-    // Getting file info using <sys/stat.h>
-    status = stat(src_filename, &buf);
+    if (status == -EPERM)
+    {
+        printf("extract-all error: Skipping %s, it would be written outside the destination\n", name);
+    }
+    else if (status < 0)
+    {
+        printf("extract-all error: Could not write %s: %s\n", name, mfs_strerror(status));
+    }
+    counts[status < 0]++;
+}
 
-    if(status == -1)
+/* The extract_all function writes every file in the disk image into destdir, which is created if
+   needed, keeping any directories in the file names. The files are written out in parallel. */
+int extract_all(char *destdir)
+{
+    if (fs == NULL)
     {
-        printf("ERROR: Could not retrieve file status\n");
-        return;
+        printf("ERROR: Disk image is not open\n");
+        return -1;
     }
 
-    // Determining which version of retrieve to use
-    if (!new_filename)
+    if (destdir == NULL)
     {
-        FILE *ofp;
-        ofp = fopen(src_filename, "w");
+        destdir = ".";
+    }
 
-        int block_index = inodes[directory[i].inode].blocks[directory[i].inode];
-        int copy_size = buf.st_size;
-        int block_offset = 0;
+    // files extracted and files that failed
+    int counts[2] = {0, 0};
+    int status = mfs_extract_all(fs, destdir, reportExtract, counts);
+    if (status < 0 && counts[0] + counts[1] == 0)
+    {
+        printf("ERROR: Could not create directory %s\n", destdir);
+        return -1;
+    }
 
-        while (copy_size > 0)
-        {
-            int num_bytes;
+    printf("%d files extracted to %s\n", counts[0], destdir);
+    return status < 0 ? -1 : 0;
+}
 
-            if( copy_size < BLOCK_SIZE )
-            {
-                num_bytes = copy_size; 
-            } 
-            else 
-            {
-                num_bytes = BLOCK_SIZE;
-            }
-            // Write num_bytes number of bytes from our data array into our output file.
-            fwrite( data[block_index], num_bytes, 1, ofp ); 
+/* The cache function limits how much of the open disk image is kept in memory to about bytes, or lifts the limit when
+   bytes is 0. Blocks that have not been read lately are then dropped and read back from the image file when needed.
+   The limit lasts until the image is closed. */
+int cache(size_t bytes)
+{
+    if (fs == NULL)
+    {
+        printf("ERROR: Disk image is not open\n");
+        return -1;
+    }
+
+    int status = mfs_set_cache_size(fs, bytes);
+    if (status < 0)
+    {
+        printf("ERROR: Could not set the cache size: %s\n", mfs_strerror(status));
+        return -1;
+    }
+
+    if (bytes == 0)
+    {
+        printf("Block cache limit removed\n");
+    }
+    else
+    {
+        printf("Block cache limited to %zu bytes\n", bytes);
+    }
+    return 0;
+}
+
+// Prints each part of the image scrub found damaged
+void reportScrub(void *arg, const char *name, int status)
+{
+    printf("scrub error: %s is damaged\n", name);
+}
+
+/* The scrub function reads every block of the disk image in use, on all cores, and checks it against the
+   checksum recorded when it was saved. Anything holding a damaged block is listed. Fails if damage is found. */
+int scrub()
+{
+    if (fs == NULL)
+    {
+        printf("ERROR: Disk image is not open\n");
+        return -1;
+    }
+
+    int status = mfs_scrub(fs, reportScrub, NULL);
+    if (status == -EOPNOTSUPP)
+    {
+        printf("ERROR: %s was made before block checksums\n", image_name);
+        return -1;
+    }
+    if (status < 0)
+    {
+        printf("ERROR: Could not scrub %s: %s\n", image_name, mfs_strerror(status));
+        return -1;
+    }
+    if (status > 0)
+    {
+        printf("Scrub found %d damaged blocks\n", status);
+        return -1;
+    }
 
-            copy_size -= BLOCK_SIZE;
-            block_offset += BLOCK_SIZE;
-            block_index++;
+    printf("Scrub found no damaged blocks\n");
+    return 0;
+}
 
-            fseek( ofp, block_offset, SEEK_SET );
+/* The snapshot function records the files of the disk image under a name, or lists the snapshots when no
+   name is given. A snapshot shares every unchanged block with the image, so taking one only copies the
+   directory and inodes. With remove set, the named snapshot is deleted instead. */
+int snapshot(char *name, int remove)
+{
+    if (fs == NULL)
+    {
+        printf("ERROR: Disk image is not open\n");
+        return -1;
+    }
+
+    if (name == NULL)
+    {
+        char    snap[MFS_NAME_MAX + 1];
+        int32_t cursor = 0;
+        while (mfs_list_snapshots(fs, &cursor, snap))
+        {
+            printf("%s\n", snap);
         }
+        return 0;
+    }
 
-        fclose(ofp);
+    int status = remove ? mfs_delete_snapshot(fs, name) : mfs_snapshot(fs, name);
+    if (status == -ENOENT)
+    {
+        printf("ERROR: Snapshot %s not found\n", name);
+        return -1;
+    }
+    if (status == -EEXIST)
+    {
+        printf("ERROR: Snapshot %s already exists\n", name);
+        return -1;
     }
-    else 
+    if (status < 0)
     {
-        FILE *ofp;
-        ofp = fopen(new_filename, "w");
+        printf("ERROR: Could not %s snapshot %s: %s\n", remove ? "delete" : "take", name, mfs_strerror(status));
+        return -1;
+    }
+
+    is_saved = 0;
+    printf("Snapshot %s %s\n", name, remove ? "deleted" : "taken");
+    return 0;
+}
 
-        int block_index = inodes[directory[i].inode].blocks[directory[i].inode];
-        int copy_size = buf.st_size;
-        int block_offset = 0;
+/* The rollback function puts the files of the disk image back the way they were when a snapshot was taken.
+   The snapshot is kept, so the image can be rolled back to it again. */
+int rollback(char *name)
+{
+    if (fs == NULL)
+    {
+        printf("ERROR: Disk image is not open\n");
+        return -1;
+    }
 
-        while (copy_size > 0)
+    int status = mfs_rollback(fs, name);
+    if (status == -ENOENT)
+    {
+        printf("ERROR: Snapshot %s not found\n", name);
+        return -1;
+    }
+    if (status < 0)
+    {
+        printf("ERROR: Could not roll back to %s: %s\n", name, mfs_strerror(status));
+        return -1;
+    }
+
+    is_saved = 0;
+    printf("Rolled back to snapshot %s\n", name);
+    return 0;
+}
+
+// Returns the latency in microseconds below which at least fraction of the runs in st finished,
+// which is the top of the histogram bucket holding that run
+uint64_t percentile(const struct commandStats *st, double fraction)
+{
+    uint64_t wanted = (uint64_t)(fraction * st->runs + 0.999999);
+    uint64_t seen   = 0;
+    int      b;
+
+    for (b = 0; b < LATENCY_BUCKETS - 1; b++)
+    {
+        seen += st->buckets[b];
+        if (seen >= wanted)
         {
-            int num_bytes;
+            break;
+        }
+    }
+
+    // the slowest run may be well below the top of its bucket
+    uint64_t top = (uint64_t)1 << b;
+    return top < st->max_ns / 1000 ? top : st->max_ns / 1000;
+}
+
+/* The stats function shows how long each command has taken since mfs started, and the counters of the open
+   image since it was opened: bytes moved, blocks allocated and freed and directory lookups. With json set
+   the same figures are printed as a single JSON object, and with reset the command timings start over. */
+int stats(int json, int reset)
+{
+    struct mfs_counters counters;
+    int i, b, first = 1;
 
-            if( copy_size < BLOCK_SIZE )
+    if (reset)
+    {
+        memset(command_stats, 0, sizeof(command_stats));
+        printf("Command statistics reset\n");
+        return 0;
+    }
+
+    if (fs != NULL)
+    {
+        mfs_get_counters(fs, &counters);
+    }
+
+    if (json)
+    {
+        printf("{\"commands\":{");
+        for (i = 0; i < NUM_COMMANDS; i++)
+        {
+            const struct commandStats *st = &command_stats[i];
+            if (st->runs == 0)
             {
-                num_bytes = copy_size; 
-            } 
-            else 
+                continue;
+            }
+            printf("%s\"%s\":{\"runs\":%" PRIu64 ",\"failed\":%" PRIu64 ",\"total_us\":%" PRIu64 ",\"p50_us\":%" PRIu64
+                   ",\"p99_us\":%" PRIu64 ",\"max_us\":%" PRIu64 ",\"histogram_us\":[",
+                   first ? "" : ",", command_names[i], st->runs, st->failures, st->total_ns / 1000,
+                   percentile(st, 0.5), percentile(st, 0.99), st->max_ns / 1000);
+
+            // [upper bound, runs] for every bucket something landed in
+            int listed = 0;
+            for (b = 0; b < LATENCY_BUCKETS; b++)
             {
-                num_bytes = BLOCK_SIZE;
+                if (st->buckets[b])
+                {
+                    printf("%s[%" PRIu64 ",%" PRIu64 "]", listed++ ? "," : "", (uint64_t)1 << b, st->buckets[b]);
+                }
             }
-            // Write num_bytes number of bytes from our data array into our output file.
-            fwrite( data[block_index], num_bytes, 1, ofp ); 
-
-            copy_size -= BLOCK_SIZE;
-            block_offset += BLOCK_SIZE;
-            block_index++;
+            printf("]}");
+            first = 0;
+        }
+        printf("},\"image\":");
+        if (fs == NULL)
+        {
+            printf("null}\n");
+            return 0;
+        }
+        printf("{\"image_bytes_read\":%" PRIu64 ",\"image_bytes_written\":%" PRIu64
+               ",\"saved_bytes\":%" PRIu64 ",\"host_bytes_read\":%" PRIu64 ",\"host_bytes_written\":%" PRIu64
+               ",\"blocks_allocated\":%" PRIu64 ",\"blocks_freed\":%" PRIu64 ",\"lookups\":%" PRIu64 "}}\n",
+               counters.image_bytes_read, counters.image_bytes_written, counters.saved_bytes,
+               counters.host_bytes_read, counters.host_bytes_written, counters.blocks_allocated,
+               counters.blocks_freed, counters.lookups);
+        return 0;
+    }
 
-            fseek( ofp, block_offset, SEEK_SET );
+    printf("%-12s %8s %8s %12s %10s %10s %10s\n", "command", "runs", "failed", "total ms", "p50 us", "p99 us", "max us");
+    for (i = 0; i < NUM_COMMANDS; i++)
+    {
+        const struct commandStats *st = &command_stats[i];
+        if (st->runs > 0)
+        {
+            printf("%-12s %8" PRIu64 " %8" PRIu64 " %12.3f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                   command_names[i], st->runs, st->failures, st->total_ns / 1e6,
+                   percentile(st, 0.5), percentile(st, 0.99), st->max_ns / 1000);
         }
+    }
 
-        fclose(ofp);
+    if (fs != NULL)
+    {
+        printf("\n%s since it was opened:\n", image_name);
+        printf("  %-19s %" PRIu64 " bytes\n", "file data read", counters.image_bytes_read);
+        printf("  %-19s %" PRIu64 " bytes\n", "file data written", counters.image_bytes_written);
+        printf("  %-19s %" PRIu64 " bytes\n", "saved to image", counters.saved_bytes);
+        printf("  %-19s %" PRIu64 " bytes\n", "host files read", counters.host_bytes_read);
+        printf("  %-19s %" PRIu64 " bytes\n", "host files written", counters.host_bytes_written);
+        printf("  %-19s %" PRIu64 "\n", "blocks allocated", counters.blocks_allocated);
+        printf("  %-19s %" PRIu64 "\n", "blocks freed", counters.blocks_freed);
+        printf("  %-19s %" PRIu64 "\n", "lookups", counters.lookups);
     }
+    return 0;
 }
 
-
 /********************************************* MAIN *****************************************************/
 
-int main()
+// Parses a size such as 4096, 64K, 16M or 1G into bytes. Returns 0 if the size is not valid
+size_t parseSize(const char *text)
 {
-  char * command_string = (char*) malloc( MAX_COMMAND_SIZE );
-  fp = NULL;
-  init();
-  while( 1 )
-  {
-    printf ("mfs> ");
-    // Read the command from the commandline.  The
-    // maximum command that will be read is MAX_COMMAND_SIZE
-    // This while command will wait here until the user
-    // inputs something since fgets returns NULL when there
-    // is no input
-    while( !fgets (command_string, MAX_COMMAND_SIZE, stdin) );
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
 
-    /* Parse input */
-    char *token[MAX_NUM_ARGUMENTS];
+    if(end == text)
+    {
+        return 0;
+    }
 
-    for( int i = 0; i < MAX_NUM_ARGUMENTS; i++ )
+    switch(*end)
     {
-      token[i] = NULL;
+        case 'G': case 'g': size *= 1024;   // fall through
+        case 'M': case 'm': size *= 1024;   // fall through
+        case 'K': case 'k': size *= 1024; end++; break;
+        case '\0': break;
+        default: return 0;
     }
 
-    int   token_count = 0;                                 
-                                                           
-    // Pointer to point to the token
-    // parsed by strsep
-    char *argument_ptr = NULL;                                                                                     
-    char *working_string  = strdup( command_string );                
+    return *end == '\0' ? (size_t)size : 0;
+}
 
-    // we are going to move the working_string pointer so
-    // keep track of its original value so we can deallocate
-    // the correct amount at the end
-    char *head_ptr = working_string;
+// Splits a command line into at most MAX_NUM_ARGUMENTS whitespace separated tokens in place,
+// without allocating. Unused token slots are set to NULL. Returns the number of tokens
+int tokenize(char *line, char *token[])
+{
+    int token_count = 0;
 
-    // Tokenize the input strings with whitespace used as the delimiter
-    while ( ( (argument_ptr = strsep(&working_string, WHITESPACE ) ) != NULL) && 
-              (token_count<MAX_NUM_ARGUMENTS))
+    for( int i = 0; i < MAX_NUM_ARGUMENTS; i++ )
     {
+      token[i] = NULL;
+    }
 
-      token[token_count] = strndup( argument_ptr, MAX_COMMAND_SIZE );
-      if( strlen( token[token_count] ) == 0 )
+    while( token_count < MAX_NUM_ARGUMENTS )
+    {
+      line += strspn( line, WHITESPACE );
+      if( *line == '\0' )
       {
-        token[token_count] = NULL;
+        break;
       }
-      token_count++;
-    }
 
-	// Allowing "blank" entries
-	if(token[0] == NULL)
-	{
-		continue;
-	}
+      token[token_count++] = line;
+      line += strcspn( line, WHITESPACE );
+      if( *line != '\0' )
+      {
+        *line++ = '\0';
+      }
+    }
+    return token_count;
+}
 
+// Runs one tokenized command. Returns 0 on success and -1 if the command failed
+int run_command(char *token[])
+{
     // Processing filesystem commands
     if( strcmp("createfs", token[0]) == 0 )
     {
         if(token[1] == NULL)
         {
             printf("createfs: Filename not provided\n");
-            continue;
+            return -1;
         }
 
-        createfs(token[1]);
+        size_t  image_size = DEFAULT_IMAGE_SIZE;
+        int32_t block_size = DEFAULT_BLOCK_SIZE;
+        int32_t num_files  = 0;
+        int     bad_option = 0;
+        int     i;
+
+        // createfs <filename> [-s size[K|M|G]] [-b block size] [-i number of files]
+        for(i = 2; i + 1 < MAX_NUM_ARGUMENTS && token[i] != NULL && !bad_option; i += 2)
+        {
+            if(token[i + 1] == NULL)
+            {
+                bad_option = 1;
+            }
+            else if(strcmp(token[i], "-s") == 0)
+            {
+                image_size = parseSize(token[i + 1]);
+                bad_option = image_size == 0;
+            }
+            else if(strcmp(token[i], "-b") == 0)
+            {
+                block_size = atoi(token[i + 1]);
+            }
+            else if(strcmp(token[i], "-i") == 0)
+            {
+                num_files  = atoi(token[i + 1]);
+                bad_option = num_files <= 0;
+            }
+            else
+            {
+                bad_option = 1;
+            }
+        }
+
+        if(bad_option)
+        {
+            printf("USAGE ERROR: createfs <filename> [-s size[K|M|G]] [-b block size] [-i number of files]\n");
+            return -1;
+        }
+
+        return createfs(token[1], image_size, block_size, num_files);
     }
 
 	else if( strcmp("savefs", token[0]) == 0 )
@@ -948,17 +1035,18 @@ int main()
         if(is_saved)
         {
             printf("ERROR: Disk image is already saved\n");
-            continue;
+            return -1;
         }
 
-		savefs();
+		return savefs();
 	}
 
 	else if( strcmp("quit", token[0]) == 0 )
 	{
-		if(image_open == 1)
+		if(fs != NULL)
 		{
 			printf("Please close your file before exiting by typing \"close\"\n");
+			return -1;
 		}
 		else
 		{
@@ -972,52 +1060,81 @@ int main()
 		if(token[1] == NULL)
 		{
 			printf("open: File not found\n");
-			continue;
+			return -1;
 		}
 
-		openfs(token[1]);
+		return openfs(token[1]);
 	}
 
 	else if( strcmp("close", token[0]) == 0)
 	{
-		closefs();
+		return closefs();
 	}
 
 	else if( strcmp("list", token[0]) == 0)
 	{
-		if(image_open == 0)
+		if(fs == NULL)
 		{
 			printf("ERROR: Disk image is not open\n");
-			continue;
+			return -1;
         }
-        list(token[1], token[2]);
+        return list(token[1], token[2]);
 	}
 
 	else if( strcmp("df", token[0]) == 0 )
 	{
-		if( image_open == 0)
+		if( fs == NULL)
 		{
 			printf("ERROR: Disk image is not open\n");
-			continue;
+			return -1;
 		}
-		uint32_t freeBytes = df();
-		printf("%d bytes free\n", freeBytes);
+		uint64_t freeBytes = mfs_df(fs);
+		printf("%" PRIu64 " bytes free\n", freeBytes);
+		return 0;
 	}
 
 	else if( strcmp("insert", token[0]) == 0 )
 	{
-		if(image_open == 0)
+		if(fs == NULL)
 		{
 			printf("ERROR: Disk image is not open\n");
-			continue;
+			return -1;
 		}
 
-		if(token[1] == NULL)
+		// insert [-r] [-d] [-c] <file|pattern|directory>...
+		int flags = 0;
+		int first = 1;
+		for(; first < MAX_NUM_ARGUMENTS && token[first] != NULL; first++)
+		{
+			if(strcmp(token[first], "-r") == 0)
+			{
+				flags |= MFS_INSERT_RECURSIVE;
+			}
+			else if(strcmp(token[first], "-d") == 0)
+			{
+				flags |= MFS_INSERT_DEDUP;
+			}
+			else if(strcmp(token[first], "-c") == 0)
+			{
+				flags |= MFS_INSERT_COMPRESS;
+			}
+			else
+			{
+				break;
+			}
+		}
+		if(first == MAX_NUM_ARGUMENTS || token[first] == NULL)
 		{
 			printf("ERROR: No filename specified\n");
-			continue;
+			return -1;
 		}
-	    file_insert(token[1]);
+
+		int count = 0;
+		while(first + count < MAX_NUM_ARGUMENTS && token[first + count] != NULL)
+		{
+			count++;
+		}
+	    return file_insert(&token[first], count, flags);
 
 	}
 
@@ -1026,10 +1143,37 @@ int main()
         if(token[1] == NULL)
 		{
 			printf("ERROR: No filename specified\n");
-			continue;
+			return -1;
+		}
+
+		return retrieve(token[1], token[2]);
+	}
+
+	else if( strcmp("extract-all", token[0]) == 0 )
+	{
+		return extract_all(token[1]);
+	}
+
+	else if( strcmp("snapshot", token[0]) == 0 )
+	{
+		// snapshot [[-d] <name>]
+		int remove = token[1] != NULL && strcmp(token[1], "-d") == 0;
+		if (remove && token[2] == NULL)
+		{
+			printf("ERROR: Snapshot name is required\n");
+			return -1;
 		}
+		return snapshot(token[1 + remove], remove);
+	}
 
-		retrieve(token[1], token[2]);
+	else if( strcmp("rollback", token[0]) == 0 )
+	{
+		if (token[1] == NULL)
+		{
+			printf("ERROR: Snapshot name is required\n");
+			return -1;
+		}
+		return rollback(token[1]);
 	}
 
 	else if( strcmp("delete", token[0]) == 0 )
@@ -1037,9 +1181,9 @@ int main()
 		if(token[1] == NULL)
 		{
 			printf("ERROR: No filename specified\n");
-			continue;
+			return -1;
 		}
-		delete(token[1]);
+		return delete(token[1]);
 	}
 
 	else if( strcmp("undel", token[0]) == 0 )
@@ -1047,48 +1191,210 @@ int main()
 		if (token[1] == NULL)
 		{
 			printf("ERROR: Filename is required\n");
-			continue;
+			return -1;
 		}
-		undel(token[1]);
+		return undel(token[1]);
 	}
 
 	else if( strcmp("attrib", token[0]) == 0 )
 	{
 		if(token[1] == NULL || token[2] == NULL)
         {
-            printf("USAGE ERROR:\nattrib [+attribute] [-attribute] <filename>\nAttributes: h (hidden), r (read only)\n");
-            continue;
+            printf("USAGE ERROR:\nattrib [+attribute] [-attribute] <filename>\nAttributes: h (hidden), r (read only), c (compressed)\n");
+            return -1;
         }
-        attrib(token[2], token[1]);
+        return attrib(token[2], token[1]);
+	}
+
+	else if( strcmp("cache", token[0]) == 0 )
+	{
+		// cache <size[K|M|G]>, where 0 removes the limit
+		size_t bytes = token[1] != NULL ? parseSize(token[1]) : 0;
+		if (token[1] == NULL || (bytes == 0 && strcmp(token[1], "0") != 0))
+		{
+			printf("USAGE ERROR: cache <size[K|M|G]>\n");
+			return -1;
+		}
+		return cache(bytes);
+	}
+
+	else if( strcmp("scrub", token[0]) == 0 )
+	{
+		return scrub();
+	}
+
+	else if( strcmp("stats", token[0]) == 0 )
+	{
+		// stats [-j | -r]
+		int json  = token[1] != NULL && strcmp(token[1], "-j") == 0;
+		int reset = token[1] != NULL && strcmp(token[1], "-r") == 0;
+		if (token[1] != NULL && !json && !reset)
+		{
+			printf("USAGE ERROR: stats [-j | -r]\n");
+			return -1;
+		}
+		return stats(json, reset);
 	}
 
 	else if( strcmp("read", token[0]) == 0 )
 	{
-		if (token[1] == NULL || token[2] == NULL || token[3] == NULL)
+		// read [-b] <filename> <starting byte> <number of bytes>
+		int binary = token[1] != NULL && strcmp(token[1], "-b") == 0;
+		if (token[1 + binary] == NULL || token[2 + binary] == NULL || token[3 + binary] == NULL)
         {
             printf("ERROR: Filename, starting byte, and number of bytes are required\n");
-            continue;
+            return -1;
         }
-        int starting_byte = atoi(token[2]);
-        int number_of_bytes = atoi(token[3]);
-        read_file(token[1], starting_byte, number_of_bytes);
+        int starting_byte = atoi(token[2 + binary]);
+        int number_of_bytes = atoi(token[3 + binary]);
+        return read_file(token[1 + binary], starting_byte, number_of_bytes, binary);
 	}
 
 	else
 	{
 		printf("ERROR: '%s' is an unrecognized command\n", token[0]);
+		return -1;
 	}
+}
 
-    // Cleanup allocated memory
-    for( int i = 0; i < MAX_NUM_ARGUMENTS; i++ )
+// Returns the monotonic clock in nanoseconds
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Runs one tokenized command like run_command, adding how long it took to its statistics
+int timed_command(char *token[])
+{
+    int i = 0;
+    while( i < NUM_COMMANDS - 1 && strcmp( command_names[i], token[0] ) != 0 )
     {
-      if( token[i] != NULL )
+      i++;
+    }
+
+    uint64_t start  = now_ns();
+    int      status = run_command( token );
+    uint64_t took   = now_ns() - start;
+
+    struct commandStats *st = &command_stats[i];
+    uint64_t us = took / 1000;
+    int      b  = us ? 64 - __builtin_clzll( us ) : 0;
+
+    st->runs++;
+    st->failures += status < 0;
+    st->total_ns += took;
+    st->max_ns    = took > st->max_ns ? took : st->max_ns;
+    st->buckets[b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1]++;
+    return status;
+}
+
+// Runs every command of a script in order. Commands are separated by newlines or semicolons and
+// lines starting with # are comments. The script is tokenized in place. Returns 0 if every command
+// succeeded and 1 as soon as one fails
+int run_script(char *script)
+{
+    char *token[MAX_NUM_ARGUMENTS];
+
+    while( *script != '\0' )
+    {
+      char *command = script;
+      script += strcspn( script, ";\n" );
+      if( *script != '\0' )
       {
-        free( token[i] );
+        *script++ = '\0';
       }
+
+      command += strspn( command, WHITESPACE );
+      if( *command == '#' || tokenize( command, token ) == 0 )
+      {
+        continue;
+      }
+
+      if( timed_command( token ) < 0 )
+      {
+        return 1;
+      }
+    }
+    return 0;
+}
+
+// Reads a whole script file into a NUL terminated buffer. Returns NULL on failure
+char *load_script(const char *filename)
+{
+    int fd = open( filename, O_RDONLY );
+    struct stat buf;
+    char *script = NULL;
+
+    if( fd >= 0 && fstat( fd, &buf ) == 0 && ( script = malloc( buf.st_size + 1 ) ) != NULL )
+    {
+      size_t done = 0;
+      ssize_t got;
+      while( done < (size_t)buf.st_size && ( got = read( fd, script + done, buf.st_size - done ) ) > 0 )
+      {
+        done += got;
+      }
+      script[done] = '\0';
     }
-    free( head_ptr );
+    if( fd >= 0 )
+    {
+      close( fd );
+    }
+    return script;
+}
+
+// With no arguments mfs runs interactively. "mfs -c 'cmd; cmd'" runs the given commands and
+// "mfs -f script" runs the commands in a file, without prompting and exiting non-zero on the first
+// failed command.
+int main( int argc, char *argv[] )
+{
+  init();
+
+  if( argc == 3 && strcmp( argv[1], "-c" ) == 0 )
+  {
+    return run_script( argv[2] );
+  }
+
+  if( argc == 3 && strcmp( argv[1], "-f" ) == 0 )
+  {
+    char *script = load_script( argv[2] );
+    if( script == NULL )
+    {
+      printf( "ERROR: Could not read script %s\n", argv[2] );
+      return 1;
+    }
+    int status = run_script( script );
+    free( script );
+    return status;
+  }
+
+  if( argc != 1 )
+  {
+    printf( "USAGE: %s [-c \"command; command\" | -f script]\n", argv[0] );
+    return 2;
+  }
+
+  char command_string[MAX_COMMAND_SIZE];
+  char *token[MAX_NUM_ARGUMENTS];
+  while( 1 )
+  {
+    printf ("mfs> ");
+    // Read the command from the commandline.  The
+    // maximum command that will be read is MAX_COMMAND_SIZE.
+    // fgets only returns NULL once stdin is closed
+    if( !fgets (command_string, MAX_COMMAND_SIZE, stdin) )
+    {
+      break;
+    }
+
+    // Allowing "blank" entries
+    if( tokenize( command_string, token ) == 0 )
+    {
+      continue;
+    }
+
+    timed_command( token );
   }
-  free( command_string );
   return 0;
-}
\ No newline at end of file
+}
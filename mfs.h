@@ -0,0 +1,179 @@
+/***********************************
+libmfs: the Mav File System core, usable without the mfs shell.
+
+Every function that can fail returns 0 (or a byte count) on success and a negative errno
+value on failure; mfs_strerror turns one into a message. Nothing is printed.
+
+A handle may be shared between threads. Calls that only look at the image (stat, readdir,
+read, retrieve, extract-all, df) run concurrently; calls that change it (insert, delete,
+undel, attributes, save) are serialized against everything else. mfs_closefs must not race
+with any other call on the same handle.
+************************************/
+#ifndef MFS_H
+#define MFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <fcntl.h>
+
+#define MFS_MIN_BLOCK_SIZE 512
+#define MFS_MAX_BLOCK_SIZE 65536
+#define MFS_NAME_MAX 63
+
+// attribute bits reported by mfs_stat and changed by mfs_set_attributes
+#define MFS_ATTR_HIDDEN     0x01
+#define MFS_ATTR_READONLY   0x02
+#define MFS_ATTR_COMPRESSED 0x04      // stored in compressed 64 KiB chunks; the first write through a handle unpacks it
+
+typedef struct mfs mfs_t;
+typedef struct mfs_file mfs_file_t;
+
+struct mfs_stat
+{
+    char     name[MFS_NAME_MAX + 1];
+    uint32_t size;
+    uint8_t  attributes;
+};
+
+// Called once for every file handled by mfs_insert and mfs_extract_all, with 0 or the
+// negative errno it failed with. Calls come from the thread that made the request while
+// the handle is locked, so a callback must not use the same handle.
+typedef void (*mfs_report_fn)(void *arg, const char *name, int status);
+
+// Creates a new image of image_size bytes made of block_size byte blocks with room for
+// num_files files (0 picks one per 16 blocks) and opens it. -EINVAL means the block size is
+// not a power of two between MFS_MIN_BLOCK_SIZE and MFS_MAX_BLOCK_SIZE, -ERANGE that the
+// image is too small for its metadata.
+int mfs_createfs(mfs_t **fs, const char *filename, size_t image_size, int32_t block_size, int32_t num_files);
+
+// Opens an existing image, first finishing a save that a crash interrupted. -EINVAL means the
+// file is not a valid image and -EIO that its metadata fails its checksums.
+int mfs_openfs(mfs_t **fs, const char *filename);
+
+// Writes every change made since the last save back to the image file and waits for it to reach
+// the disk. If the system crashes during a save, the image opens as of that save or the one before.
+// Free and all-zero blocks are left as holes in the file where the host file system allows it, and
+// files deleted before the save can no longer be undeleted. New data only goes to blocks the last save
+// still gives to a deleted file once every other free block is taken, and such blocks, like the extent lists
+// a save changes, must fit in the journal; extent lists that do not are moved to blocks the last save left
+// free. -ENOSPC means that was not possible and nothing was written. Saving after large deletes avoids it.
+int mfs_savefs(mfs_t *fs);
+
+// Closes the image and frees the handle, discarding unsaved changes
+void mfs_closefs(mfs_t *fs);
+
+// Returns the number of free bytes in the image
+uint64_t mfs_df(mfs_t *fs);
+
+// Limits the memory the handle keeps image blocks in to about bytes, or lifts the limit with 0, which
+// is how a handle starts. Past the limit the blocks read least recently are dropped and read from the
+// file again if they are needed; blocks changed since the last save stay until it. Best set right after
+// the image is opened, since blocks read before the limit is set are not counted.
+int mfs_set_cache_size(mfs_t *fs, size_t bytes);
+
+// running totals for a handle, counted from when it was opened
+struct mfs_counters
+{
+    uint64_t image_bytes_read;        // file data copied out of the image by reads, retrieve and extract-all
+    uint64_t image_bytes_written;     // file data written into the image by insert and through handles
+    uint64_t saved_bytes;             // bytes saves wrote to the image file, journal included
+    uint64_t host_bytes_read;         // bytes insert read from host files
+    uint64_t host_bytes_written;      // bytes retrieve and extract-all wrote to host files
+    uint64_t blocks_allocated;
+    uint64_t blocks_freed;
+    uint64_t lookups;                 // directory lookups by file name
+};
+
+// Copies the handle's counters into counters. Cheap enough to call at any time, and never blocks.
+void mfs_get_counters(mfs_t *fs, struct mfs_counters *counters);
+
+int mfs_stat(mfs_t *fs, const char *name, struct mfs_stat *st);
+
+// Fills st with the next file after *cursor, which starts at 0. Returns 1 while there are
+// files left and 0 at the end.
+int mfs_readdir(mfs_t *fs, int32_t *cursor, struct mfs_stat *st);
+
+// Copies up to count bytes starting at offset out of a file. Returns the number of bytes
+// copied, which is 0 at or past the end of the file. Compressed files only unpack the chunks
+// the range covers. -EIO means a block of the range fails its checksum or a chunk is damaged.
+// Every read, including retrieve, extract-all and mfs_pread, checks each block the first
+// time it reads it after the image is opened.
+ssize_t mfs_read_file(mfs_t *fs, const char *name, void *buf, size_t count, uint64_t offset);
+
+// flags for mfs_insert
+#define MFS_INSERT_RECURSIVE 0x01     // insert directories with everything under them
+#define MFS_INSERT_DEDUP     0x02     // share blocks that hold the same bytes as one already in the image
+#define MFS_INSERT_COMPRESS  0x04     // store files compressed when that saves at least a block
+
+// Inserts host files, each of which may be a glob pattern, under their own names. The whole
+// batch is placed before any data is copied, so it needs room for every block even when
+// deduplicating or compressing; -ENOSPC and -ENFILE (no free directory slot) mean nothing was inserted.
+// Otherwise returns the first per-file failure, if any. Images that predate snapshots
+// cannot share blocks and ignore MFS_INSERT_DEDUP.
+int mfs_insert(mfs_t *fs, char *const *host_paths, int count, int flags, mfs_report_fn report, void *arg);
+
+// Copies a file out to host_path
+int mfs_retrieve(mfs_t *fs, const char *name, const char *host_path);
+
+// Writes every file under destdir, creating it and any directories in the file names.
+// -EPERM is reported for names that would land outside destdir.
+int mfs_extract_all(mfs_t *fs, const char *destdir, mfs_report_fn report, void *arg);
+
+// -EPERM means the file is read only
+int mfs_delete(mfs_t *fs, const char *name);
+
+// -EEXIST means the file has not been deleted, -ESTALE that its inode or blocks have been reused or
+// that the image has been saved since the delete
+int mfs_undel(mfs_t *fs, const char *name);
+
+// Sets the attribute bits in set and then clears those in clear. Changing MFS_ATTR_COMPRESSED
+// rewrites the file into new blocks and can fail with -ENOSPC; a file that would not shrink by a
+// block is left uncompressed.
+int mfs_set_attributes(mfs_t *fs, const char *name, uint8_t set, uint8_t clear);
+
+// Checks every block in use against its checksum, using all cores, and calls report with -EIO for each
+// metadata region ("inode table", ...), "snapshot <name>" and file holding a damaged block. Returns
+// the number of damaged blocks, including any that only snapshot files use. Blocks changed since the
+// last save are not checked. -EOPNOTSUPP means the image predates checksums.
+int mfs_scrub(mfs_t *fs, mfs_report_fn report, void *arg);
+
+// Records the files of the image as snapshot name. Snapshots share data blocks with the image and
+// each other; a block is only copied when a handle writes to it. -EEXIST means the name is taken,
+// -EMLINK that every snapshot slot is in use and -EOPNOTSUPP that the image predates snapshots.
+int mfs_snapshot(mfs_t *fs, const char *name);
+
+// Puts the files of the image back the way they were in snapshot name, which is kept. Open handles
+// stay valid only if the snapshot has their file in the same directory slot and inode.
+int mfs_rollback(mfs_t *fs, const char *name);
+
+// Drops a snapshot, freeing the blocks only it was using
+int mfs_delete_snapshot(mfs_t *fs, const char *name);
+
+// Copies the name of the next snapshot after *cursor, which starts at 0, into name, which has room
+// for MFS_NAME_MAX + 1 bytes. Returns 1 while there are snapshots left and 0 at the end.
+int mfs_list_snapshots(mfs_t *fs, int32_t *cursor, char *name);
+
+// Opens a file through a handle. flags are the O_ flags from fcntl.h: the access mode plus any of
+// O_CREAT, O_EXCL, O_TRUNC and O_APPEND. -EACCES means the file is read only. A handle must
+// not outlive its image. Once its file is deleted or replaced, a handle returns -ESTALE.
+int mfs_open(mfs_t *fs, const char *name, int flags, mfs_file_t **file);
+
+// Read and write at an offset, leaving the position alone. Writes allocate blocks only as they
+// reach them and extend the file as needed; -ENOSPC means nothing was written.
+ssize_t mfs_pread(mfs_file_t *file, void *buf, size_t count, uint64_t offset);
+ssize_t mfs_pwrite(mfs_file_t *file, const void *buf, size_t count, uint64_t offset);
+
+// Read and write at the position and move it past the bytes transferred. With O_APPEND every
+// write goes to the end of the file. One thread at a time may use a handle's position.
+ssize_t mfs_read(mfs_file_t *file, void *buf, size_t count);
+ssize_t mfs_write(mfs_file_t *file, const void *buf, size_t count);
+
+// Moves the position like lseek(2) and returns the new one
+int64_t mfs_lseek(mfs_file_t *file, int64_t offset, int whence);
+
+int mfs_close(mfs_file_t *file);
+
+const char *mfs_strerror(int status);
+
+#endif
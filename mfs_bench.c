@@ -0,0 +1,636 @@
+/***********************************
+mfs_bench: times the core libmfs operations on synthetic workloads.
+
+HOW TO COMPILE mfs_bench.c:
+
+gcc -O2 -Wall -Werror --std=c99 mfs_bench.c libmfs.c -pthread -ldl -o mfs_bench
+
+USAGE: mfs_bench [-d scratch_dir] [-n iterations] [-w small|large|fragmented]
+
+Each workload writes its source files under scratch_dir (default /tmp) and then, once per iteration,
+builds an image from them and runs every operation over it. Results go to stdout as one JSON object
+per line and operation: how often it ran, the files and bytes it handled, throughput, p50/p99/max
+latency in microseconds and the system calls libmfs made while it ran. Those are counted by wrapping
+the libc functions libmfs calls, so they cover libmfs alone and not the benchmark around it. I/O that
+libmfs batches through io_uring shows up as io_uring_enter calls and the requests they submitted
+(io_uring_requests) rather than as reads and writes.
+************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#include "mfs.h"
+
+#define DEFAULT_ITERATIONS 5
+#define DF_CALLS 1000                   // df is too quick to time one call at a time
+#define READ_CHUNK (64 * 1024)          // read_file is called with this much at a time
+#define MIB (1024 * 1024)
+
+// a synthetic workload: files files of min_size to max_size bytes inserted as one batch. Workloads with
+// filler first fill the image with filler_size byte files and delete every other one, so the files
+// measured are scattered over the holes.
+struct workload
+{
+    const char *name;
+    int         files;
+    size_t      min_size;
+    size_t      max_size;
+    int         filler;
+    size_t      filler_size;
+    size_t      image_size;
+    int32_t     block_size;
+    int32_t     num_files;
+};
+
+static const struct workload workloads[] =
+{
+    { "small",      2000, 512,        16 * 1024,  0, 0,        64 * MIB,  1024, 0 },
+    { "large",      4,    16 * MIB,   16 * MIB,   0, 0,        128 * MIB, 4096, 0 },
+    { "fragmented", 100,  64 * 1024,  256 * 1024, 1, 8 * 1024, 64 * MIB,  1024, 16384 },
+};
+
+/*************************************** SYSTEM CALL COUNTS ********************************************/
+
+// The functions below stand in for the libc ones libmfs calls. Each counts the call and passes it on
+// to the real function, found with dlsym once at startup. The kinds from CALL_WRAPPED on have no libc
+// function of their own: they are the system calls libmfs makes through syscall, counted apart.
+
+enum
+{
+    CALL_OPEN, CALL_CLOSE, CALL_READ, CALL_WRITE, CALL_PREAD, CALL_PWRITE, CALL_PWRITEV, CALL_FDATASYNC,
+    CALL_FALLOCATE, CALL_COPY_FILE_RANGE, CALL_SENDFILE, CALL_FTRUNCATE, CALL_MMAP, CALL_MUNMAP,
+    CALL_FADVISE, CALL_MADVISE, CALL_MKDIR, CALL_SYSCALL, CALL_WRAPPED,
+    CALL_IO_URING_SETUP = CALL_WRAPPED, CALL_IO_URING_ENTER, CALL_IO_URING_REQUESTS, CALL_KINDS
+};
+
+static const char *call_names[CALL_KINDS] =
+{
+    "open", "close", "read", "write", "pread", "pwrite", "pwritev", "fdatasync",
+    "fallocate", "copy_file_range", "sendfile", "ftruncate", "mmap", "munmap",
+    "posix_fadvise", "madvise", "mkdir", "syscall",
+    "io_uring_setup", "io_uring_enter", "io_uring_requests"
+};
+
+static uint64_t call_counts[CALL_KINDS];
+static void    *real_calls[CALL_KINDS];
+
+#define COUNT_CALLS(kind, n) __atomic_fetch_add(&call_counts[kind], n, __ATOMIC_RELAXED)
+#define COUNT_CALL(kind) COUNT_CALLS(kind, 1)
+
+// Helper function that looks up the libc function behind every wrapper
+static void findRealCalls()
+{
+    int i;
+    for (i = 0; i < CALL_WRAPPED; i++)
+    {
+        if (!(real_calls[i] = dlsym(RTLD_NEXT, call_names[i])))
+        {
+            fprintf(stderr, "mfs_bench: Could not find %s: %s\n", call_names[i], dlerror());
+            exit(1);
+        }
+    }
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    COUNT_CALL(CALL_OPEN);
+    return ((int (*)(const char *, int, ...))real_calls[CALL_OPEN])(path, flags, mode);
+}
+
+int close(int fd)
+{
+    COUNT_CALL(CALL_CLOSE);
+    return ((int (*)(int))real_calls[CALL_CLOSE])(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    COUNT_CALL(CALL_READ);
+    return ((ssize_t (*)(int, void *, size_t))real_calls[CALL_READ])(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    COUNT_CALL(CALL_WRITE);
+    return ((ssize_t (*)(int, const void *, size_t))real_calls[CALL_WRITE])(fd, buf, count);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    COUNT_CALL(CALL_PREAD);
+    return ((ssize_t (*)(int, void *, size_t, off_t))real_calls[CALL_PREAD])(fd, buf, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    COUNT_CALL(CALL_PWRITE);
+    return ((ssize_t (*)(int, const void *, size_t, off_t))real_calls[CALL_PWRITE])(fd, buf, count, offset);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    COUNT_CALL(CALL_PWRITEV);
+    return ((ssize_t (*)(int, const struct iovec *, int, off_t))real_calls[CALL_PWRITEV])(fd, iov, iovcnt, offset);
+}
+
+int fdatasync(int fd)
+{
+    COUNT_CALL(CALL_FDATASYNC);
+    return ((int (*)(int))real_calls[CALL_FDATASYNC])(fd);
+}
+
+int fallocate(int fd, int mode, off_t offset, off_t len)
+{
+    COUNT_CALL(CALL_FALLOCATE);
+    return ((int (*)(int, int, off_t, off_t))real_calls[CALL_FALLOCATE])(fd, mode, offset, len);
+}
+
+ssize_t copy_file_range(int in_fd, off64_t *in_off, int out_fd, off64_t *out_off, size_t len, unsigned int flags)
+{
+    COUNT_CALL(CALL_COPY_FILE_RANGE);
+    return ((ssize_t (*)(int, off64_t *, int, off64_t *, size_t, unsigned int))real_calls[CALL_COPY_FILE_RANGE])(
+        in_fd, in_off, out_fd, out_off, len, flags);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    COUNT_CALL(CALL_SENDFILE);
+    return ((ssize_t (*)(int, int, off_t *, size_t))real_calls[CALL_SENDFILE])(out_fd, in_fd, offset, count);
+}
+
+int ftruncate(int fd, off_t length)
+{
+    COUNT_CALL(CALL_FTRUNCATE);
+    return ((int (*)(int, off_t))real_calls[CALL_FTRUNCATE])(fd, length);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    COUNT_CALL(CALL_MMAP);
+    return ((void *(*)(void *, size_t, int, int, int, off_t))real_calls[CALL_MMAP])(addr, length, prot, flags, fd, offset);
+}
+
+int munmap(void *addr, size_t length)
+{
+    COUNT_CALL(CALL_MUNMAP);
+    return ((int (*)(void *, size_t))real_calls[CALL_MUNMAP])(addr, length);
+}
+
+int posix_fadvise(int fd, off_t offset, off_t len, int advice)
+{
+    COUNT_CALL(CALL_FADVISE);
+    return ((int (*)(int, off_t, off_t, int))real_calls[CALL_FADVISE])(fd, offset, len, advice);
+}
+
+int madvise(void *addr, size_t length, int advice)
+{
+    COUNT_CALL(CALL_MADVISE);
+    return ((int (*)(void *, size_t, int))real_calls[CALL_MADVISE])(addr, length, advice);
+}
+
+int mkdir(const char *path, mode_t mode)
+{
+    COUNT_CALL(CALL_MKDIR);
+    return ((int (*)(const char *, mode_t))real_calls[CALL_MKDIR])(path, mode);
+}
+
+// libmfs sets up and drives its io_uring through syscall. Every system call takes at most six arguments,
+// so all six are passed on whatever the call. An io_uring_enter that submits requests returns how many.
+long syscall(long number, ...)
+{
+    long    args[6];
+    va_list list;
+    int     i;
+
+    va_start(list, number);
+    for (i = 0; i < 6; i++)
+    {
+        args[i] = va_arg(list, long);
+    }
+    va_end(list);
+
+    long status = ((long (*)(long, ...))real_calls[CALL_SYSCALL])(number, args[0], args[1], args[2], args[3],
+                                                                  args[4], args[5]);
+#ifdef __NR_io_uring_enter
+    if (number == __NR_io_uring_setup)
+    {
+        COUNT_CALL(CALL_IO_URING_SETUP);
+        return status;
+    }
+    if (number == __NR_io_uring_enter)
+    {
+        COUNT_CALL(CALL_IO_URING_ENTER);
+        COUNT_CALLS(CALL_IO_URING_REQUESTS, args[1] && status > 0 ? status : 0);
+        return status;
+    }
+#endif
+    COUNT_CALL(CALL_SYSCALL);
+    return status;
+}
+
+/*************************************** MEASUREMENT ********************************************/
+
+// everything recorded about one operation of one workload
+struct opStats
+{
+    const char *name;
+    double     *samples;        // seconds each run took
+    int         count;
+    int         capacity;
+    uint64_t    items;
+    uint64_t    bytes;
+    double      seconds;
+    uint64_t    calls[CALL_KINDS];
+};
+
+// the clock and system call counts when a timed run started
+struct probe
+{
+    struct timespec start;
+    uint64_t        calls[CALL_KINDS];
+};
+
+static void startProbe(struct probe *probe)
+{
+    memcpy(probe->calls, call_counts, sizeof(call_counts));
+    clock_gettime(CLOCK_MONOTONIC, &probe->start);
+}
+
+// Helper function that adds a run that handled items files and bytes bytes, begun at probe, to stats
+static void endProbe(struct opStats *stats, const struct probe *probe, uint64_t items, uint64_t bytes)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - probe->start.tv_sec) + (end.tv_nsec - probe->start.tv_nsec) / 1e9;
+
+    int i;
+    for (i = 0; i < CALL_KINDS; i++)
+    {
+        stats->calls[i] += call_counts[i] - probe->calls[i];
+    }
+
+    if (stats->count == stats->capacity)
+    {
+        stats->capacity = stats->capacity ? stats->capacity * 2 : 64;
+        if (!(stats->samples = realloc(stats->samples, stats->capacity * sizeof(double))))
+        {
+            fprintf(stderr, "mfs_bench: Out of memory\n");
+            exit(1);
+        }
+    }
+    stats->samples[stats->count++] = seconds;
+    stats->seconds += seconds;
+    stats->items   += items;
+    stats->bytes   += bytes;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Helper function that returns the pct percentile of a sorted set of samples, by nearest rank
+static double percentile(const double *samples, int count, int pct)
+{
+    int rank = (count * pct + 99) / 100;
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+// Helper function that prints the JSON line for one operation of a workload
+static void reportStats(const char *workload, struct opStats *stats)
+{
+    if (stats->count == 0)
+    {
+        return;
+    }
+    qsort(stats->samples, stats->count, sizeof(double), compareSamples);
+
+    printf("{\"workload\":\"%s\",\"op\":\"%s\",\"runs\":%d,\"items\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+           "\"items_per_sec\":%.1f,\"mib_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"syscalls\":{",
+           workload, stats->name, stats->count, (unsigned long long)stats->items, (unsigned long long)stats->bytes,
+           stats->seconds, stats->seconds > 0 ? stats->items / stats->seconds : 0,
+           stats->seconds > 0 ? stats->bytes / stats->seconds / MIB : 0,
+           percentile(stats->samples, stats->count, 50) * 1e6, percentile(stats->samples, stats->count, 99) * 1e6,
+           stats->samples[stats->count - 1] * 1e6);
+
+    int i;
+    for (i = 0; i < CALL_KINDS; i++)
+    {
+        printf("%s\"%s\":%llu", i ? "," : "", call_names[i], (unsigned long long)stats->calls[i]);
+    }
+    printf("}}\n");
+    fflush(stdout);
+
+    free(stats->samples);
+    stats->samples = NULL;
+}
+
+/*************************************** WORKLOADS ********************************************/
+
+// Helper function that stops the benchmark when a libmfs call fails
+static void check(int status, const char *what)
+{
+    if (status < 0)
+    {
+        fprintf(stderr, "mfs_bench: %s failed: %s\n", what, mfs_strerror(status));
+        exit(1);
+    }
+}
+
+// Helper function that returns the next number of a xorshift sequence, so every run builds the same files
+static uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Helper function that writes count host files of min_size to max_size bytes named dir/fNNNNN and returns
+// their total size. The contents are words drawn from a small vocabulary, which compress like text does.
+static uint64_t writeSources(const char *dir, int count, size_t min_size, size_t max_size, uint64_t seed)
+{
+    static const char *words[] = { "the ", "block ", "image ", "file ", "extent ", "inode ", "of ", "a ",
+                                   "save ", "journal ", "data ", "free ", "map ", "and ", "to ", "in " };
+    uint8_t *buf = malloc(max_size);
+    uint64_t total = 0;
+    int i;
+
+    if (!buf || (mkdir(dir, 0755) < 0 && errno != EEXIST))
+    {
+        fprintf(stderr, "mfs_bench: Could not create %s\n", dir);
+        exit(1);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        size_t size = min_size + (max_size > min_size ? nextRandom(&seed) % (max_size - min_size + 1) : 0);
+        size_t pos = 0;
+        while (pos < size)
+        {
+            uint64_t r = nextRandom(&seed);
+            const char *word = words[r % 16];
+            size_t len = strlen(word);
+            if (r % 97 == 0)
+            {
+                // a sprinkling of numbers keeps the files from all being alike
+                len = snprintf((char *)buf + pos, size - pos, "%llu ", (unsigned long long)(r >> 40));
+                len = pos + len > size ? size - pos : len;
+            }
+            else
+            {
+                len = pos + len > size ? size - pos : len;
+                memcpy(buf + pos, word, len);
+            }
+            pos += len;
+        }
+
+        char path[64];
+        snprintf(path, sizeof(path), "%s/f%05d", dir, i);
+        FILE *f = fopen(path, "w");
+        if (!f || fwrite(buf, 1, size, f) != size || fclose(f) != 0)
+        {
+            fprintf(stderr, "mfs_bench: Could not write %s\n", path);
+            exit(1);
+        }
+        total += size;
+    }
+
+    free(buf);
+    return total;
+}
+
+// Helper function that deletes the host files writeSources made and their directory
+static void removeSources(const char *dir, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/f%05d", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+// Helper function that returns how many filler files fill an empty image of the workload's geometry
+// to within a MiB, leaving no room for the measured files but the holes fragmentImage makes
+static int fillerCount(const struct workload *w)
+{
+    mfs_t *fs;
+    check(mfs_createfs(&fs, "sizing.img", w->image_size, w->block_size, w->num_files), "createfs");
+    uint64_t free_bytes = mfs_df(fs);
+    mfs_closefs(fs);
+    unlink("sizing.img");
+    return free_bytes > MIB ? (free_bytes - MIB) / w->filler_size : 0;
+}
+
+// Helper function that inserts count filler files into a new image and deletes every other one
+static void fragmentImage(mfs_t *fs, int count)
+{
+    char *filler[] = { "filler" };
+    char name[64];
+    int i;
+
+    check(mfs_insert(fs, filler, 1, MFS_INSERT_RECURSIVE, NULL, NULL), "insert filler");
+    for (i = 0; i < count; i += 2)
+    {
+        snprintf(name, sizeof(name), "filler/f%05d", i);
+        check(mfs_delete(fs, name), "delete filler");
+    }
+    check(mfs_savefs(fs), "savefs");
+}
+
+// Helper function that runs every operation of a workload iterations times and prints the results
+static void runWorkload(const struct workload *w, int iterations)
+{
+    enum { OP_CREATEFS, OP_INSERT, OP_SAVEFS, OP_OPENFS, OP_READ_FILE, OP_RETRIEVE, OP_DF, OP_DELETE, OP_COUNT };
+    static const char *op_names[OP_COUNT] =
+    {
+        "createfs", "insert", "savefs", "openfs", "read_file", "retrieve", "df", "delete"
+    };
+    struct opStats stats[OP_COUNT];
+    struct probe probe;
+    int i, n;
+
+    memset(stats, 0, sizeof(stats));
+    for (i = 0; i < OP_COUNT; i++)
+    {
+        stats[i].name = op_names[i];
+    }
+
+    uint64_t total = writeSources(w->name, w->files, w->min_size, w->max_size, 0x9E3779B97F4A7C15ULL);
+    int filler_count = 0;
+    if (w->filler)
+    {
+        filler_count = fillerCount(w);
+        writeSources("filler", filler_count, w->filler_size, w->filler_size, 0x2545F4914F6CDD1DULL);
+    }
+
+    uint8_t *buf = malloc(READ_CHUNK);
+    char image[64];
+    snprintf(image, sizeof(image), "%s.img", w->name);
+
+    for (n = 0; n < iterations; n++)
+    {
+        mfs_t *fs;
+        char   name[64];
+
+        startProbe(&probe);
+        check(mfs_createfs(&fs, image, w->image_size, w->block_size, w->num_files), "createfs");
+        endProbe(&stats[OP_CREATEFS], &probe, 0, 0);
+
+        if (w->filler)
+        {
+            fragmentImage(fs, filler_count);
+        }
+
+        char *sources[] = { (char *)w->name };
+        startProbe(&probe);
+        check(mfs_insert(fs, sources, 1, MFS_INSERT_RECURSIVE, NULL, NULL), "insert");
+        endProbe(&stats[OP_INSERT], &probe, w->files, total);
+
+        startProbe(&probe);
+        check(mfs_savefs(fs), "savefs");
+        endProbe(&stats[OP_SAVEFS], &probe, 0, 0);
+
+        // the page cache still holds the image, so this is the cost of mapping it and checking the metadata
+        mfs_closefs(fs);
+        startProbe(&probe);
+        check(mfs_openfs(&fs, image), "openfs");
+        endProbe(&stats[OP_OPENFS], &probe, 0, 0);
+
+        for (i = 0; i < w->files; i++)
+        {
+            struct mfs_stat st;
+            uint64_t offset = 0;
+            ssize_t  got;
+
+            snprintf(name, sizeof(name), "%s/f%05d", w->name, i);
+            check(mfs_stat(fs, name, &st), "stat");
+            startProbe(&probe);
+            while ((got = mfs_read_file(fs, name, buf, READ_CHUNK, offset)) > 0)
+            {
+                offset += got;
+            }
+            check(got, "read_file");
+            endProbe(&stats[OP_READ_FILE], &probe, 1, offset);
+
+            startProbe(&probe);
+            check(mfs_retrieve(fs, name, "retrieved"), "retrieve");
+            endProbe(&stats[OP_RETRIEVE], &probe, 1, st.size);
+        }
+        unlink("retrieved");
+
+        startProbe(&probe);
+        for (i = 0; i < DF_CALLS; i++)
+        {
+            mfs_df(fs);
+        }
+        endProbe(&stats[OP_DF], &probe, DF_CALLS, 0);
+
+        for (i = 0; i < w->files; i++)
+        {
+            snprintf(name, sizeof(name), "%s/f%05d", w->name, i);
+            startProbe(&probe);
+            check(mfs_delete(fs, name), "delete");
+            endProbe(&stats[OP_DELETE], &probe, 1, 0);
+        }
+
+        mfs_closefs(fs);
+        unlink(image);
+    }
+
+    for (i = 0; i < OP_COUNT; i++)
+    {
+        reportStats(w->name, &stats[i]);
+    }
+
+    free(buf);
+    removeSources(w->name, w->files);
+    if (w->filler)
+    {
+        removeSources("filler", filler_count);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *scratch = "/tmp";
+    const char *only = NULL;
+    int iterations = DEFAULT_ITERATIONS;
+    int opt;
+
+    findRealCalls();
+
+    while ((opt = getopt(argc, argv, "d:n:w:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': scratch = optarg; break;
+            case 'n': iterations = atoi(optarg); break;
+            case 'w': only = optarg; break;
+            default:
+                fprintf(stderr, "USAGE: %s [-d scratch_dir] [-n iterations] [-w small|large|fragmented]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (iterations < 1)
+    {
+        fprintf(stderr, "mfs_bench: iterations must be at least 1\n");
+        return 2;
+    }
+
+    // everything happens in a directory of our own, named relative to it so the names fit in an image
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/mfs_bench.XXXXXX", scratch);
+    if (!mkdtemp(dir) || chdir(dir) < 0)
+    {
+        fprintf(stderr, "mfs_bench: Could not make a scratch directory in %s: %s\n", scratch, strerror(errno));
+        return 1;
+    }
+
+    size_t i;
+    int ran = 0;
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        if (!only || strcmp(only, workloads[i].name) == 0)
+        {
+            runWorkload(&workloads[i], iterations);
+            ran = 1;
+        }
+    }
+
+    if (chdir("..") == 0)
+    {
+        rmdir(dir);
+    }
+    if (!ran)
+    {
+        fprintf(stderr, "mfs_bench: Unknown workload %s\n", only);
+        return 2;
+    }
+    return 0;
+}
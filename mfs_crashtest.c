@@ -0,0 +1,305 @@
+/***********************************
+mfs_crashtest: checks that a save cut short by a crash leaves an image that opens as of that save or the
+one before.
+
+HOW TO COMPILE mfs_crashtest.c:
+
+gcc -O2 -Wall -Werror --std=c99 mfs_crashtest.c libmfs.c -pthread -o mfs_crashtest
+
+USAGE: mfs_crashtest [-d scratch_dir]
+
+Each case builds an image in scratch_dir (default /tmp) and saves it, then changes it and saves again
+in a child process that dies at its first, second, ... fdatasync, until one save gets through. After
+every crash the image is opened again and must hold either the files of the first save or those of
+the second, with every byte intact. Prints one line per case and exits with 1 if any failed.
+************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "mfs.h"
+
+#define MIB (1024 * 1024)
+#define MAX_CRASHES 64                  // fdatasync calls a save may make before we stop looking for more
+#define CRASH_EXIT 3                    // status the child dies with when the crash point is reached
+
+// a file a case puts in the image: its name, its size and the seed its bytes are made from
+struct testFile
+{
+    const char *name;
+    size_t      size;
+    uint32_t    seed;
+};
+
+// a crash case: the files the first save holds, the ones deleted after it and the ones inserted in their
+// place before the second save
+struct crashCase
+{
+    const char       *name;
+    size_t            image_size;
+    int32_t           block_size;
+    struct testFile   before[2];
+    const char       *deleted;
+    struct testFile   after;
+};
+
+static const struct crashCase cases[] =
+{
+    // plenty of room, so the new file never needs the deleted one's blocks
+    { "replace", 16 * MIB, 1024, { { "A", 3 * MIB, 1 } }, "A", { "B", 3 * MIB, 2 } },
+    // a full image, so the new file can only go where the deleted one was, which fits in the journal
+    { "reuse", 4 * MIB, 1024, { { "A", 48 * 1024, 1 }, { "filler", 0, 3 } }, "A", { "B", 48 * 1024, 2 } },
+    // as above with more reused blocks than the journal holds, so the save has to refuse
+    { "reuse-overflow", 4 * MIB, 1024, { { "A", 1 * MIB, 1 }, { "filler", 0, 3 } }, "A", { "B", 1 * MIB, 2 } },
+};
+
+static int crash_at = -1;               // fdatasync call a child dies at, or -1 to never die
+static int sync_calls;
+
+// Stands in for the libc fdatasync, which libmfs calls to order its writes. The crash point is right
+// after the data reaches the disk, since dying before it is the same as dying at the previous call.
+int fdatasync(int fd)
+{
+    int status = syscall(SYS_fdatasync, fd);
+    if (++sync_calls == crash_at)
+    {
+        _exit(CRASH_EXIT);
+    }
+    return status;
+}
+
+// Helper function that fills buf with the size bytes of a test file
+static void fileBytes(const struct testFile *file, uint8_t *buf, size_t size)
+{
+    uint32_t x = file->seed * 2654435761u + 1;
+    size_t i;
+    for (i = 0; i < size; i++)
+    {
+        x = x * 1664525 + 1013904223;
+        buf[i] = x >> 24;
+    }
+}
+
+// Helper function that writes a test file of size bytes to host_path. Returns 0 on success and -1 on failure
+static int writeSource(const struct testFile *file, size_t size, const char *host_path)
+{
+    uint8_t *buf = malloc(size ? size : 1);
+    FILE *out = fopen(host_path, "w");
+    int status = buf && out ? 0 : -1;
+    if (status == 0)
+    {
+        fileBytes(file, buf, size);
+        status = fwrite(buf, 1, size, out) == size ? 0 : -1;
+    }
+    if (out)
+    {
+        fclose(out);
+    }
+    free(buf);
+    return status;
+}
+
+// Helper function that inserts a test file of size bytes under its own name, by way of a host file of that
+// name in the scratch directory, which is the working directory. Returns 0 or a negative errno
+static int insertFile(mfs_t *fs, const struct testFile *file, size_t size)
+{
+    if (writeSource(file, size, file->name) < 0)
+    {
+        return -EIO;
+    }
+
+    char *paths[] = { (char *)file->name };
+    int status = mfs_insert(fs, paths, 1, 0, NULL, NULL);
+    unlink(file->name);
+    return status;
+}
+
+// Helper function that returns 1 if the image holds file with every byte intact and 0 otherwise
+static int fileIntact(mfs_t *fs, const struct testFile *file, size_t size)
+{
+    struct mfs_stat st;
+    if (mfs_stat(fs, file->name, &st) < 0 || st.size != size)
+    {
+        return 0;
+    }
+
+    uint8_t *want = malloc(size ? size : 1);
+    uint8_t *got  = malloc(size ? size : 1);
+    int intact = want && got && mfs_read_file(fs, file->name, got, size, 0) == (ssize_t)size;
+    if (intact)
+    {
+        fileBytes(file, want, size);
+        intact = memcmp(want, got, size) == 0;
+    }
+    free(want);
+    free(got);
+    return intact;
+}
+
+// Helper function that returns 1 if the image holds a file called name
+static int hasFile(mfs_t *fs, const char *name)
+{
+    struct mfs_stat st;
+    return mfs_stat(fs, name, &st) == 0;
+}
+
+// Helper function that builds the image of a case as of its first save and records the size of each file
+// in sizes. A filler file of size 0 takes up all of the space left. Returns 0 on success and -1 on failure
+static int buildImage(const struct crashCase *c, const char *image, size_t *sizes)
+{
+    mfs_t *fs;
+    int i;
+
+    unlink(image);
+    if (mfs_createfs(&fs, image, c->image_size, c->block_size, 0) < 0)
+    {
+        return -1;
+    }
+    for (i = 0; i < 2 && c->before[i].name; i++)
+    {
+        sizes[i] = c->before[i].size ? c->before[i].size : mfs_df(fs);
+        if (insertFile(fs, &c->before[i], sizes[i]) < 0)
+        {
+            mfs_closefs(fs);
+            return -1;
+        }
+    }
+    int status = mfs_savefs(fs);
+    mfs_closefs(fs);
+    return status < 0 ? -1 : 0;
+}
+
+// Helper function that opens image after a crash and returns 1 if it holds the files of the first save,
+// 2 if it holds those of the second and 0 if it holds neither intact
+static int imageState(const struct crashCase *c, const char *image, const size_t *sizes)
+{
+    mfs_t *fs;
+    int state = 0;
+    int i;
+
+    if (mfs_openfs(&fs, image) < 0)
+    {
+        return 0;
+    }
+    if (!hasFile(fs, c->after.name))
+    {
+        state = 1;
+        for (i = 0; i < 2 && c->before[i].name; i++)
+        {
+            state = state && fileIntact(fs, &c->before[i], sizes[i]);
+        }
+    }
+    else if (!hasFile(fs, c->deleted) && fileIntact(fs, &c->after, c->after.size))
+    {
+        state = 2;
+        for (i = 0; i < 2 && c->before[i].name; i++)
+        {
+            if (strcmp(c->before[i].name, c->deleted) != 0)
+            {
+                state = fileIntact(fs, &c->before[i], sizes[i]) ? state : 0;
+            }
+        }
+    }
+    mfs_closefs(fs);
+    return state;
+}
+
+// Helper function that runs the second half of a case, dying at the crash_at'th fdatasync. Exits with 0 if
+// the save went through, 2 if it was refused with -ENOSPC and 1 on any other failure.
+static void changeImage(const struct crashCase *c, const char *image)
+{
+    mfs_t *fs;
+    if (mfs_openfs(&fs, image) < 0 || mfs_delete(fs, c->deleted) < 0 || insertFile(fs, &c->after, c->after.size) < 0)
+    {
+        _exit(1);
+    }
+    int status = mfs_savefs(fs);
+    _exit(status == 0 ? 0 : status == -ENOSPC ? 2 : 1);
+}
+
+// Helper function that runs one case, crashing its second save at every point in turn. Returns 0 if the image
+// always came back as of one save or the other, and -1 if not
+static int runCase(const struct crashCase *c)
+{
+    const char *image = "mfs_crashtest.img";
+    size_t      sizes[2] = { 0, 0 };
+    int         crashes = 0;
+    int         refused = 0;
+    int         point;
+
+    for (point = 1; point <= MAX_CRASHES; point++)
+    {
+        if (buildImage(c, image, sizes) < 0)
+        {
+            printf("%-16s FAIL: could not build the image\n", c->name);
+            return -1;
+        }
+
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0)
+        {
+            sync_calls = 0;
+            crash_at   = point;
+            changeImage(c, image);
+        }
+        int wstatus;
+        if (child < 0 || waitpid(child, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) == 1)
+        {
+            printf("%-16s FAIL: the change before crash %d failed\n", c->name, point);
+            return -1;
+        }
+
+        int state = imageState(c, image, sizes);
+        int done  = WEXITSTATUS(wstatus) != CRASH_EXIT;
+        refused   = WEXITSTATUS(wstatus) == 2;
+        if (state == 0 || (done && state != (refused ? 1 : 2)))
+        {
+            printf("%-16s FAIL: %s %d left the image as of neither save\n", c->name, done ? "the save after" : "crash", point);
+            return -1;
+        }
+        if (done)
+        {
+            break;
+        }
+        crashes++;
+    }
+    unlink(image);
+    printf("%-16s ok: %d crash points%s\n", c->name, crashes, refused ? ", save refused with -ENOSPC" : "");
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *scratch_dir = "/tmp";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1)
+    {
+        if (opt != 'd')
+        {
+            fprintf(stderr, "USAGE: %s [-d scratch_dir]\n", argv[0]);
+            return 1;
+        }
+        scratch_dir = optarg;
+    }
+
+    if (chdir(scratch_dir) < 0)
+    {
+        perror(scratch_dir);
+        return 1;
+    }
+
+    int failed = 0;
+    size_t i;
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        failed |= runCase(&cases[i]) < 0;
+    }
+    return failed;
+}
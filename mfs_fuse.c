@@ -0,0 +1,354 @@
+/***********************************
+mfs_fuse: mounts an mfs image through FUSE so ordinary tools can use it.
+
+HOW TO COMPILE mfs_fuse.c:
+
+gcc -g -Wall -Werror --std=c99 mfs_fuse.c libmfs.c $(pkg-config --cflags --libs fuse3) -pthread -o mfs_fuse
+
+USAGE: mfs_fuse [-m cache MiB] <image> <mountpoint> [FUSE options]
+
+Changes are written back to the image on fsync and when the file system is unmounted. With -m, no
+more than about that much of the image is kept in memory once it has been saved.
+************************************/
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "mfs.h"
+
+#define MAX_IO_BYTES (1024 * 1024)    // largest read or write we ask the kernel to send in one request
+
+// File names in an image may contain slashes; the directories they imply exist for as long as
+// some file lives under them. mfs has no empty directories, timestamps or owners.
+
+// Helper function that returns the image mounted by this process
+static mfs_t *mountedImage()
+{
+    return fuse_get_context()->private_data;
+}
+
+// Helper function that turns a FUSE path into an mfs file name by dropping the leading slash.
+// Returns the name, or NULL if it is too long to be one.
+static const char *fileName(const char *path)
+{
+    while (*path == '/')
+    {
+        path++;
+    }
+    return strlen(path) > MFS_NAME_MAX ? NULL : path;
+}
+
+// Helper function that returns 1 if some file lives under the directory dir ("" is the root)
+static int isDirectory(mfs_t *fs, const char *dir)
+{
+    size_t length = strlen(dir);
+    int32_t cursor = 0;
+    struct mfs_stat st;
+
+    if (length == 0)
+    {
+        return 1;
+    }
+    while (mfs_readdir(fs, &cursor, &st))
+    {
+        if (strncmp(st.name, dir, length) == 0 && st.name[length] == '/')
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int mfsGetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+    mfs_t *fs = mountedImage();
+    const char *name = fileName(path);
+    struct mfs_stat st;
+
+    if (!name)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+
+    if (*name && mfs_stat(fs, name, &st) == 0)
+    {
+        stbuf->st_mode   = S_IFREG | (st.attributes & MFS_ATTR_READONLY ? 0444 : 0644);
+        stbuf->st_nlink  = 1;
+        stbuf->st_size   = st.size;
+        stbuf->st_blocks = (st.size + 511) / 512;
+        return 0;
+    }
+    if (isDirectory(fs, name))
+    {
+        stbuf->st_mode  = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+    return -ENOENT;
+}
+
+static int mfsReaddir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                      struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    mfs_t *fs = mountedImage();
+    const char *dir = fileName(path);
+
+    if (!dir)
+    {
+        return -ENAMETOOLONG;
+    }
+    if (!isDirectory(fs, dir))
+    {
+        return -ENOENT;
+    }
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+
+    // a subdirectory shows up once per file under it, so remember the ones already listed
+    size_t length = strlen(dir);
+    char (*listed)[MFS_NAME_MAX + 1] = NULL;
+    int listed_count = 0;
+    int listed_capacity = 0;
+    int32_t cursor = 0;
+    struct mfs_stat st;
+
+    while (mfs_readdir(fs, &cursor, &st))
+    {
+        if (length && (strncmp(st.name, dir, length) != 0 || st.name[length] != '/'))
+        {
+            continue;
+        }
+
+        char *child = st.name + (length ? length + 1 : 0);
+        char *slash = strchr(child, '/');
+        if (!slash)
+        {
+            filler(buf, child, NULL, 0, 0);
+            continue;
+        }
+
+        *slash = '\0';
+        int i;
+        for (i = 0; i < listed_count && strcmp(listed[i], child) != 0; i++)
+        {
+        }
+        if (i < listed_count)
+        {
+            continue;
+        }
+        if (listed_count == listed_capacity)
+        {
+            int capacity = listed_capacity ? listed_capacity * 2 : 16;
+            void *grown = realloc(listed, capacity * sizeof(*listed));
+            if (!grown)
+            {
+                free(listed);
+                return -ENOMEM;
+            }
+            listed = grown;
+            listed_capacity = capacity;
+        }
+        strcpy(listed[listed_count++], child);
+        filler(buf, child, NULL, 0, 0);
+    }
+
+    free(listed);
+    return 0;
+}
+
+static int mfsOpen(const char *path, struct fuse_file_info *fi)
+{
+    const char *name = fileName(path);
+    mfs_file_t *file;
+
+    if (!name)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    int status = mfs_open(mountedImage(), name, fi->flags & (O_ACCMODE | O_TRUNC), &file);
+    if (status < 0)
+    {
+        return status;
+    }
+    fi->fh = (uint64_t)(uintptr_t)file;
+    return 0;
+}
+
+static int mfsCreate(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    const char *name = fileName(path);
+    mfs_file_t *file;
+
+    if (!name)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    int status = mfs_open(mountedImage(), name, fi->flags & (O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC), &file);
+    if (status < 0)
+    {
+        return status;
+    }
+    fi->fh = (uint64_t)(uintptr_t)file;
+    return 0;
+}
+
+static int mfsRead(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    return mfs_pread((mfs_file_t *)(uintptr_t)fi->fh, buf, size, offset);
+}
+
+static int mfsWrite(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    return mfs_pwrite((mfs_file_t *)(uintptr_t)fi->fh, buf, size, offset);
+}
+
+static int mfsRelease(const char *path, struct fuse_file_info *fi)
+{
+    return mfs_close((mfs_file_t *)(uintptr_t)fi->fh);
+}
+
+static int mfsUnlink(const char *path)
+{
+    const char *name = fileName(path);
+    return name ? mfs_delete(mountedImage(), name) : -ENAMETOOLONG;
+}
+
+// Files can be emptied or grown, which covers O_TRUNC and shells' '>' redirection. mfs cannot
+// shorten a file to anything but zero.
+static int mfsTruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    mfs_t *fs = mountedImage();
+    const char *name = fileName(path);
+    mfs_file_t *file;
+    struct mfs_stat st;
+
+    if (!name)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    int status = mfs_stat(fs, name, &st);
+    if (status < 0 || (uint64_t)size == st.size)
+    {
+        return status;
+    }
+    if (size != 0 && (uint64_t)size < st.size)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    if ((status = mfs_open(fs, name, size == 0 ? O_WRONLY | O_TRUNC : O_WRONLY, &file)) < 0)
+    {
+        return status;
+    }
+    if (size > 0)
+    {
+        // every byte past the old end reads as zero, so writing the last one is enough
+        ssize_t written = mfs_pwrite(file, "", 1, size - 1);
+        status = written < 0 ? written : 0;
+    }
+    mfs_close(file);
+    return status;
+}
+
+// mfs keeps no timestamps, so touch has nothing to change
+static int mfsUtimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+    return mfsGetattr(path, &stbuf, fi);
+}
+
+static int mfsFsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return mfs_savefs(mountedImage());
+}
+
+static void *mfsInit(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    // big requests keep the number of round trips through the kernel down
+    conn->max_write     = MAX_IO_BYTES;
+    conn->max_read      = MAX_IO_BYTES;
+    conn->max_readahead = MAX_IO_BYTES;
+
+    // nothing but us changes the image while it is mounted
+    cfg->kernel_cache = 1;
+    cfg->use_ino      = 0;
+    return mountedImage();
+}
+
+static void mfsDestroy(void *private_data)
+{
+    mfs_t *fs = private_data;
+    int status = mfs_savefs(fs);
+    if (status < 0)
+    {
+        fprintf(stderr, "mfs_fuse: Could not save the image: %s\n", mfs_strerror(status));
+    }
+    mfs_closefs(fs);
+}
+
+static const struct fuse_operations mfs_operations =
+{
+    .getattr  = mfsGetattr,
+    .readdir  = mfsReaddir,
+    .open     = mfsOpen,
+    .create   = mfsCreate,
+    .read     = mfsRead,
+    .write    = mfsWrite,
+    .release  = mfsRelease,
+    .unlink   = mfsUnlink,
+    .truncate = mfsTruncate,
+    .utimens  = mfsUtimens,
+    .fsync    = mfsFsync,
+    .init     = mfsInit,
+    .destroy  = mfsDestroy,
+};
+
+int main(int argc, char *argv[])
+{
+    size_t cache_mib = 0;
+    if (argc >= 3 && strcmp(argv[1], "-m") == 0)
+    {
+        cache_mib = strtoull(argv[2], NULL, 10);
+        argv[2]   = argv[0];
+        argv     += 2;
+        argc     -= 2;
+    }
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "USAGE: %s [-m cache MiB] <image> <mountpoint> [FUSE options]\n", argv[0]);
+        return 2;
+    }
+
+    mfs_t *fs;
+    int status = mfs_openfs(&fs, argv[1]);
+    if (status < 0)
+    {
+        fprintf(stderr, "mfs_fuse: Could not open %s: %s\n", argv[1], mfs_strerror(status));
+        return 1;
+    }
+    if (cache_mib > 0 && (status = mfs_set_cache_size(fs, cache_mib << 20)) < 0)
+    {
+        fprintf(stderr, "mfs_fuse: Could not set up the block cache: %s\n", mfs_strerror(status));
+        mfs_closefs(fs);
+        return 1;
+    }
+
+    // FUSE gets everything but the image; requests are dispatched on several threads unless -s is given
+    argv[1] = argv[0];
+    return fuse_main(argc - 1, argv + 1, &mfs_operations, fs);
+}